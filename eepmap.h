@@ -13,6 +13,12 @@
 
 #define EEP_ADDR_HP3478_EXT_EN   10
 
+#define EEP_ADDR_GPIB_RX_TMO     12 /* 2 */
+#define EEP_ADDR_GPIB_TX_TMO     14 /* 2 */
+#define EEP_ADDR_GPIB_TRACE      16
+#define EEP_ADDR_GPIB_HP3478_SAD 17
+#define EEP_ADDR_UART_UBRR       18 /* 2 */
+
 #define EEP_ADDR_CONT_RANGE      20
 #define EEP_ADDR_CONT_THRESHOLD  24
 #define EEP_ADDR_CONT_LATCH      28
@@ -25,6 +31,8 @@
 
 #define EEP_ADDR_MODE            60 /* 2 */
 #define EEP_ADDR_EXT_MODE        62
+#define EEP_ADDR_GPIB_PX_ADDR    64
+#define EEP_ADDR_GPIB_PX_SAD     65
 
 #define EEP_ADDR_ERR_DISP        70
 
@@ -35,6 +43,9 @@
 #define EEP_SIZE_CONT_BEEP_T1     2
 #define EEP_SIZE_CONT_BEEP_T2     2
 #define EEP_SIZE_MODE             2
+#define EEP_SIZE_GPIB_RX_TMO      2
+#define EEP_SIZE_GPIB_TX_TMO      2
+#define EEP_SIZE_UART_UBRR        2
 
 /* set 0, used for uninitalized eeprom */
 #define EEP_DEF0_BEEP_DUTY        15
@@ -42,6 +53,7 @@
 
 #define EEP_DEF0_UART_BAUD        0 /* UART_115200 */
 #define EEP_DEF0_UART_ECHO        1
+#define EEP_DEF0_UART_UBRR        16 /* 115200 */
 
 #define EEP_DEF0_GPIB_END_SEQ_TX  4 /* GPIB_END_EOI */
 #define EEP_DEF0_GPIB_END_SEQ_RX  4
@@ -50,6 +62,13 @@
 
 #define EEP_DEF0_HP3478_EXT_EN   0
 
+#define EEP_DEF0_GPIB_RX_TMO     2000 /* 200ms */
+#define EEP_DEF0_GPIB_TX_TMO     2000
+#define EEP_DEF0_GPIB_TRACE      0
+#define EEP_DEF0_GPIB_HP3478_SAD 31 /* none */
+#define EEP_DEF0_GPIB_PX_ADDR    23
+#define EEP_DEF0_GPIB_PX_SAD     31
+
 #define EEP_DEF0_CONT_RANGE      1  /* 300 Ohm */
 #define EEP_DEF0_CONT_THRESHOLD  1000 /* 100 ohm in 300 Ohm range */
 #define EEP_DEF0_CONT_LATCH      0  /* no latch */
@@ -0,0 +1,155 @@
+#pragma once
+/* GPIB pin access.
+   The firmware touches the bus only through these primitives. The AVR build
+   maps them to port registers, the host build (see host/) to a virtual bus. */
+
+#define SET_PORT_PIN(PORT, PIN, V) if(V) PORT |= PIN; else PORT &= ~PIN
+#define CAT(a, b) a ## b
+#define PORT(X) CAT(PORT, X)
+#define DDR(X) CAT(DDR, X)
+#define PIN(X) CAT(PIN, X)
+
+/* pin change interrupts for DAV (receive engine) and SRQ */
+#define GPIB_DAV_vect PCINT0_vect
+#define GPIB_SRQ_vect PCINT1_vect
+
+#ifndef HOST
+
+/* PIN assignment */
+/*
+ GPIB|       |                    |            | atmega  |
+ pin | name  | description        | direction  | pin     |    
+ ----+-------+--------------------+------------+---------+
+ 1   | DIO1  | Data bit 1 (LSB)   | Talker     | PD2  32 | 2
+ 2   | DIO2  | Data bit 2         | Talker     | PD3   1 | 3
+ 3   | DIO3  | Data bit 3         | Talker     | PD4   2 | 4
+ 4   | DIO4  | Data bit 4         | Talker     | PD5   9 | 5
+ 5   | EOI   | End Of Identity    | Talker     | PB3  15 | 11
+ 6   | DAV   | Data Valid         | Talker     | PB4  16 | 12
+ 7   | NRFD  | Not Ready For Data | Listener   | PC0  23 | A0
+ 8   | NDAC  | No Data Accepted   | Listener   | PC1  24 | A1
+ 9   | IFC   | Interface Clear    | Controller | PC2  25 | A2
+ 10  | SRQ   | Service Request    | Slave      | PC3  26 | A3
+ 11  | ATN   | Attention          | Controller | PC4  27 | A4
+ 12  |       | Shield             |            |         |
+ 13  | DIO5  | Data bit 5         | Talker     | PD6  10 | 6
+ 14  | DIO6  | Data bit 6         | Talker     | PD7  11 | 7
+ 15  | DIO7  | Data Bit 7         | Talker     | PB0  12 | 8
+ 16  | DIO8  | Data bit 8 (MSB)   | Talker     | PB1  13 | 9
+ 17  | REN   | Remote Enabled     | Controller | PC5  28 | A5
+ 18  |       | GND DAV            |            |         |
+ 19  |       | GND NRFD           |            |         |
+ 20  |       | GND NDAC           |            |         |
+ 21  |       | GND IFC            |            |         |
+ 22  |       | GND SRQ            |            |         |
+ 23  |       | GND ATN            |            |         |
+ 24  |       | GND data           |            |         |
+
+     | LED   |                    | OUT        | PB5     |
+     |BUZZER | Buzzer PWM (OC1B)  | OUT        | PB2     |
+*/
+
+#define EOI  _BV(PB3)
+#define EOI_PORT B
+#define DAV  _BV(PB4)
+#define DAV_PORT B
+#define DAV_PCINT _BV(PCINT4)
+#define NRFD _BV(PC0)
+#define NRFD_PORT C
+#define NDAC _BV(PC1)
+#define NDAC_PORT C
+#define IFC  _BV(PC2)
+#define IFC_PORT C
+#define SRQ  _BV(PC3)
+#define SRQ_PORT C
+#define SRQ_PCINT _BV(PCINT11)
+#define ATN  _BV(PC4)
+#define ATN_PORT C
+#define REN  _BV(PC5)
+#define REN_PORT C
+
+static inline void cfg_data_in(void) {
+  DDRD &= ~(_BV(PD2)|_BV(PD3)|_BV(PD4)|_BV(PD5)|_BV(PD6)|_BV(PD7));
+  DDRB &= ~(_BV(PB0)|_BV(PB1));
+}
+static inline void cfg_data_out(void) {
+  /* DDRD |= (_BV(PD2)|_BV(PD3)|_BV(PD4)|_BV(PD5)|_BV(PD6)|_BV(PD7));
+     DDRB |= (_BV(PB0)|_BV(PB1)); */
+}
+
+static inline uint8_t data_get(void) {
+  uint8_t d;
+  d = PIND;
+  d >>= 2;
+  if(PINB & _BV(PB0)) d |= 64;
+  if(PINB & _BV(PB1)) d |= 128;
+  return ~d;
+}
+
+static inline void data_put(uint8_t d) {
+  /* DIO1-6 are PD2-7 and DIO7-8 are PB0-1, so two shifts map the byte */
+  DDRD = (DDRD&0x3) | (d<<2);
+  DDRB = (DDRB&~(_BV(PB0)|_BV(PB1))) | (d>>6);
+}
+
+static inline void eoi_set(uint8_t x) {SET_PORT_PIN(DDR(EOI_PORT), EOI, (x));}
+static inline void dav_set(uint8_t x) {SET_PORT_PIN(DDR(DAV_PORT), DAV, (x));}
+static inline void nrfd_set(uint8_t x) {SET_PORT_PIN(DDR(NRFD_PORT), NRFD, (x));}
+static inline void ndac_set(uint8_t x) {SET_PORT_PIN(DDR(NDAC_PORT), NDAC, (x));}
+static inline void SetIFC(uint8_t x) {SET_PORT_PIN(DDR(IFC_PORT), IFC, !(x));}
+static inline void set_atn(uint8_t x) {
+ SET_PORT_PIN(DDR(ATN_PORT), ATN, (x));
+ if(x) _delay_us(0.5); /* T7 in ieee488 spec */
+}
+static inline void set_ren(uint8_t x) {SET_PORT_PIN(DDR(REN_PORT), REN, (x));}
+
+static inline uint8_t dav(void) {return !(PIN(DAV_PORT) & DAV);}
+static inline uint8_t ndac(void) {return !(PIN(NDAC_PORT) & NDAC);}
+static inline uint8_t nrfd(void) {return !(PIN(NRFD_PORT) & NRFD);}
+static inline uint8_t srq(void) {return !(PIN(SRQ_PORT) & SRQ);}
+static inline uint8_t eoi(void) {return !(PIN(EOI_PORT) & EOI);}
+static inline uint8_t ren(void) {return (DDR(REN_PORT) & REN);}
+static inline uint8_t atn(void) {return (DDR(ATN_PORT) & ATN);}
+
+/* pullup on DAV so reads won't return garbage while listening */
+static inline void dav_pullup(uint8_t x) {SET_PORT_PIN(PORT(DAV_PORT), DAV, (x));}
+
+static inline void dav_irq_disable(void) {PCMSK0 &= ~DAV_PCINT;}
+static inline void dav_irq_enable(void) {
+ PCIFR = _BV(PCIF0);
+ PCMSK0 |= DAV_PCINT;
+}
+
+static inline void gpib_hal_init(void) {
+ PORT(SRQ_PORT) |= SRQ;
+ PCMSK1 = SRQ_PCINT;
+ PCMSK0 = 0; /* DAV, enabled by gpib_rx_start */
+ PCICR = _BV(PCIE1)|_BV(PCIE0);
+}
+
+#else /* HOST */
+
+void cfg_data_in(void);
+void cfg_data_out(void);
+uint8_t data_get(void);
+void data_put(uint8_t d);
+void eoi_set(uint8_t x);
+void dav_set(uint8_t x);
+void nrfd_set(uint8_t x);
+void ndac_set(uint8_t x);
+void SetIFC(uint8_t x);
+void set_atn(uint8_t x);
+void set_ren(uint8_t x);
+uint8_t dav(void);
+uint8_t ndac(void);
+uint8_t nrfd(void);
+uint8_t srq(void);
+uint8_t eoi(void);
+uint8_t ren(void);
+uint8_t atn(void);
+void dav_pullup(uint8_t x);
+void dav_irq_disable(void);
+void dav_irq_enable(void);
+void gpib_hal_init(void);
+
+#endif
@@ -0,0 +1,310 @@
+/* Host build: the AVR core and avr-libc services the firmware relies on.
+   TIMER0 overflow (every 1ms) and TIMER2 compare match (CTC mode) are raised
+   from a thread, the other timers and the LED/buzzer pins are plain
+   variables. */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/eeprom.h>
+
+#include "host.h"
+
+#define HOST_REG8(r) volatile uint8_t r;
+#define HOST_REG16(r) volatile uint16_t r;
+#include "avr/regs.h"
+
+void TIMER0_OVF_vect(void);
+void TIMER2_COMPA_vect(void);
+
+/* interrupts
+   The other threads only raise an interrupt, the ISR runs on the firmware
+   thread (the one calling sei()): from a signal, or, while the interrupts
+   are disabled or a HAL call is in progress, on sei() or on the return
+   from the call. So the main code and the ISRs never run at the same
+   time, as on the AVR. */
+#define IRQ_MAX 8
+#define IRQ_SIG SIGUSR1
+
+static void (*volatile irq_vec[IRQ_MAX])(void);
+static uint8_t irq_pend[IRQ_MAX];
+static volatile uint8_t irq_n;
+static pthread_mutex_t irq_vec_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t fw_thread;
+static uint8_t fw_started;
+static __thread uint8_t on_fw;
+static volatile sig_atomic_t irq_off = 1; /* the I flag is clear after a reset */
+static __thread volatile sig_atomic_t in_hal;
+
+/* runs the pending ISRs, in the order the vectors were first raised */
+static void
+irq_run(void)
+{
+ uint8_t i = 0;
+
+ if(!on_fw || irq_off || in_hal) return;
+ while(i < irq_n) {
+  if(!__atomic_exchange_n(&irq_pend[i], 0, __ATOMIC_ACQ_REL)) {
+   i++;
+   continue;
+  }
+  irq_off = 1;
+  irq_vec[i]();
+  irq_off = 0;
+  i = 0;
+ }
+}
+
+static void
+irq_signal(int sig)
+{
+ int e = errno;
+ irq_run();
+ errno = e;
+}
+
+void
+host_cli(void)
+{
+ irq_off = 1;
+}
+
+void
+host_sei(void)
+{
+ struct sigaction sa;
+
+ if(!fw_started) {
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = irq_signal;
+  sa.sa_flags = SA_RESTART;
+  sigaction(IRQ_SIG, &sa, NULL);
+  fw_thread = pthread_self();
+  on_fw = 1;
+  __atomic_store_n(&fw_started, 1, __ATOMIC_RELEASE);
+ }
+ irq_off = 0;
+ irq_run();
+}
+
+void
+host_irq(void (*isr)(void))
+{
+ uint8_t i;
+
+ for(i = 0; i < irq_n && irq_vec[i] != isr; i++);
+ if(i == irq_n) {
+  pthread_mutex_lock(&irq_vec_lock);
+  for(i = 0; i < irq_n && irq_vec[i] != isr; i++);
+  if(i == irq_n) {
+   if(i == IRQ_MAX) abort();
+   irq_vec[i] = isr;
+   irq_n = i+1;
+  }
+  pthread_mutex_unlock(&irq_vec_lock);
+ }
+ __atomic_store_n(&irq_pend[i], 1, __ATOMIC_RELEASE);
+ if(on_fw) irq_run();
+ else if(__atomic_load_n(&fw_started, __ATOMIC_ACQUIRE)) pthread_kill(fw_thread, IRQ_SIG);
+}
+
+void
+host_hal_begin(void)
+{
+ in_hal++;
+}
+
+void
+host_hal_end(void)
+{
+ if(!--in_hal) irq_run();
+}
+
+/* time */
+uint64_t
+host_time_ns(void)
+{
+ struct timespec t;
+ clock_gettime(CLOCK_MONOTONIC, &t);
+ return (uint64_t)t.tv_sec*1000000000 + t.tv_nsec;
+}
+
+void
+host_delay_ns(uint64_t ns)
+{
+ uint64_t end = host_time_ns() + ns;
+ while(host_time_ns() < end);
+}
+
+/* TIMER2 compare match period, assumes CTC mode */
+static uint64_t
+timer2_period_ns(void)
+{
+ static const uint16_t div[8] = {0, 1, 8, 32, 64, 128, 256, 1024};
+ return (uint64_t)(OCR2A+1)*div[TCCR2B & 7]*1000/16; /* 16MHz */
+}
+
+static void
+ts_add(struct timespec *t, uint64_t ns)
+{
+ ns += t->tv_nsec;
+ t->tv_sec += ns/1000000000;
+ t->tv_nsec = ns%1000000000;
+}
+
+static int
+ts_before(const struct timespec *a, const struct timespec *b)
+{
+ return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/* the enable bits are checked again when the ISR runs, a timer may have
+   been stopped while the interrupt was pending */
+static void timer0_isr(void) {if(TIMSK0 & _BV(TOIE0)) TIMER0_OVF_vect();}
+static void timer2_isr(void) {if(TIMSK2 & _BV(OCIE2A)) TIMER2_COMPA_vect();}
+
+static void *
+timer_thread(void *arg)
+{
+ struct timespec t0, t2, *t;
+ uint8_t t2_on = 0;
+
+ clock_gettime(CLOCK_MONOTONIC, &t0);
+ ts_add(&t0, 1000000);
+ for(;;) {
+  if((TIMSK2 & _BV(OCIE2A)) && timer2_period_ns()) {
+   if(!t2_on) {
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    ts_add(&t2, timer2_period_ns());
+    t2_on = 1;
+   }
+  } else t2_on = 0;
+  t = t2_on && ts_before(&t2, &t0) ? &t2 : &t0;
+  clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, t, NULL);
+  if(t == &t0) {
+   ts_add(&t0, 1000000);
+   if(TIMSK0 & _BV(TOIE0)) host_irq(timer0_isr);
+  } else {
+   ts_add(&t2, timer2_period_ns());
+   if(TIMSK2 & _BV(OCIE2A)) host_irq(timer2_isr);
+  }
+ }
+ return NULL;
+}
+
+static void __attribute__((constructor))
+timer_start(void)
+{
+ pthread_t t;
+ pthread_create(&t, NULL, timer_thread, NULL);
+}
+
+/* EEPROM */
+#define EEPROM_SIZE 1024
+static uint8_t eeprom[EEPROM_SIZE];
+static int eeprom_fd = -2;
+
+static void
+eeprom_open(void)
+{
+ const char *f = getenv("HP3478EXT_EEPROM");
+
+ memset(eeprom, 0xff, sizeof(eeprom));
+ eeprom_fd = -1;
+ if(!f) return;
+ eeprom_fd = open(f, O_RDWR|O_CREAT, 0644);
+ if(eeprom_fd < 0) {
+  perror(f);
+  exit(1);
+ }
+ if(pread(eeprom_fd, eeprom, sizeof(eeprom), 0) < 0) perror(f);
+}
+
+static uint8_t *
+eeprom_ptr(const void *p, unsigned len)
+{
+ uintptr_t a = (uintptr_t)p;
+ if(eeprom_fd == -2) eeprom_open();
+ if(a+len > EEPROM_SIZE) {
+  fprintf(stderr, "eeprom: bad address %lu\n", (unsigned long)a);
+  abort();
+ }
+ return eeprom+a;
+}
+
+static void
+eeprom_sync(const void *p, unsigned len)
+{
+ if(eeprom_fd < 0) return;
+ if(pwrite(eeprom_fd, eeprom+(uintptr_t)p, len, (uintptr_t)p) != len) perror("eeprom");
+}
+
+uint8_t
+eeprom_read_byte(const uint8_t *p)
+{
+ return *eeprom_ptr(p, 1);
+}
+
+uint16_t
+eeprom_read_word(const uint16_t *p)
+{
+ uint8_t *e = eeprom_ptr(p, 2);
+ return e[0] | e[1]<<8;
+}
+
+void
+eeprom_write_byte(uint8_t *p, uint8_t v)
+{
+ *eeprom_ptr(p, 1) = v;
+ eeprom_sync(p, 1);
+}
+
+void
+eeprom_write_word(uint16_t *p, uint16_t v)
+{
+ uint8_t *e = eeprom_ptr(p, 2);
+ e[0] = v;
+ e[1] = v>>8;
+ eeprom_sync(p, 2);
+}
+
+void
+eeprom_update_byte(uint8_t *p, uint8_t v)
+{
+ if(*eeprom_ptr(p, 1) != v) eeprom_write_byte(p, v);
+}
+
+/* stdio, output goes to the stream set up with fdevopen() */
+static int (*stdout_put)(char, FILE *);
+
+FILE *
+fdevopen(int (*put)(char, FILE *), int (*get)(FILE *))
+{
+ if(put) stdout_put = put;
+ return stdout;
+}
+
+int
+printf_P(const char *fmt, ...)
+{
+ char *buf;
+ va_list ap;
+ int i, n;
+
+ va_start(ap, fmt);
+ n = vasprintf(&buf, fmt, ap);
+ va_end(ap);
+ if(n < 0) return n;
+ for(i = 0; i < n && stdout_put; i++) stdout_put(buf[i], stdout);
+ free(buf);
+ return n;
+}
@@ -0,0 +1,10 @@
+#pragma once
+/* host build: EEPROM is kept in memory, or in the file named by
+   HP3478EXT_EEPROM if it's set */
+#include <stdint.h>
+
+uint8_t eeprom_read_byte(const uint8_t *p);
+uint16_t eeprom_read_word(const uint16_t *p);
+void eeprom_write_byte(uint8_t *p, uint8_t v);
+void eeprom_write_word(uint16_t *p, uint16_t v);
+void eeprom_update_byte(uint8_t *p, uint8_t v);
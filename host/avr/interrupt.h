@@ -0,0 +1,10 @@
+#pragma once
+/* host build: ISRs raised by the timer and virtual bus threads run on the
+   firmware thread, see avr.c */
+
+#define ISR(vect) void vect(void); void vect(void)
+
+void host_cli(void);
+void host_sei(void);
+#define cli() host_cli()
+#define sei() host_sei()
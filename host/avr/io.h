@@ -0,0 +1,31 @@
+#pragma once
+/* host build: I/O registers are plain variables (see avr.c), only the GPIB
+   lines (gpib_hal.h) and the UART (uart.c) are emulated */
+#include <stdint.h>
+
+#define _BV(b) (1u<<(b))
+
+#define HOST_REG8(r) extern volatile uint8_t r;
+#define HOST_REG16(r) extern volatile uint16_t r;
+#include "regs.h"
+#undef HOST_REG8
+#undef HOST_REG16
+
+enum {PB0, PB1, PB2, PB3, PB4, PB5, PB6, PB7};
+enum {PC0, PC1, PC2, PC3, PC4, PC5, PC6};
+enum {PD0, PD1, PD2, PD3, PD4, PD5, PD6, PD7};
+
+enum {WGM00 = 0, WGM01 = 1, WGM02 = 3, CS00 = 0, CS01 = 1, CS02 = 2};
+enum {TOIE0 = 0, OCIE0A = 1, OCIE0B = 2, TOV0 = 0, OCF0A = 1, OCF0B = 2};
+enum {WGM10 = 0, WGM11 = 1, WGM12 = 3, WGM13 = 4, CS10 = 0, CS11 = 1, CS12 = 2};
+enum {COM1B0 = 4, COM1B1 = 5, COM1A0 = 6, COM1A1 = 7, ICES1 = 6, ICNC1 = 7};
+enum {TOIE1 = 0, OCIE1A = 1, OCIE1B = 2, ICIE1 = 5, TOV1 = 0, OCF1A = 1, OCF1B = 2, ICF1 = 5};
+enum {WGM20 = 0, WGM21 = 1, WGM22 = 3, CS20 = 0, CS21 = 1, CS22 = 2};
+enum {TOIE2 = 0, OCIE2A = 1, OCIE2B = 2, TOV2 = 0, OCF2A = 1, OCF2B = 2};
+enum {PCIE0 = 0, PCIE1 = 1, PCIE2 = 2, PCIF0 = 0, PCIF1 = 1, PCIF2 = 2};
+enum {PCINT0 = 0, PCINT1, PCINT2, PCINT3, PCINT4, PCINT5, PCINT6, PCINT7};
+enum {PCINT8 = 0, PCINT9, PCINT10, PCINT11, PCINT12, PCINT13, PCINT14};
+enum {PCINT16 = 0, PCINT17, PCINT18, PCINT19, PCINT20, PCINT21, PCINT22, PCINT23};
+enum {MPCM0 = 0, U2X0, UPE0, DOR0, FE0, UDRE0, TXC0, RXC0};
+enum {TXB80 = 0, RXB80, UCSZ02, TXEN0, RXEN0, UDRIE0, TXCIE0, RXCIE0};
+enum {UCPOL0 = 0, UCSZ00, UCSZ01, USBS0, UPM00, UPM01, UMSEL00, UMSEL01};
@@ -0,0 +1,16 @@
+#pragma once
+/* host build: there's only one address space */
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define PGM_P const char *
+
+#define pgm_read_byte(p) (*(const uint8_t *)(uintptr_t)(p))
+#define pgm_read_word(p) (*(const uint16_t *)(uintptr_t)(p))
+
+#define memcpy_P memcpy
+#define strlen_P strlen
+#define strcmp_P strcmp
+#define strncmp_P strncmp
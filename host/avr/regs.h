@@ -0,0 +1,14 @@
+/* register list for avr/io.h and avr.c, no include guard */
+HOST_REG8(PORTB) HOST_REG8(PORTC) HOST_REG8(PORTD)
+HOST_REG8(DDRB) HOST_REG8(DDRC) HOST_REG8(DDRD)
+HOST_REG8(PINB) HOST_REG8(PINC) HOST_REG8(PIND)
+HOST_REG8(TCCR0A) HOST_REG8(TCCR0B) HOST_REG8(OCR0A) HOST_REG8(OCR0B)
+HOST_REG8(TIMSK0) HOST_REG8(TIFR0) HOST_REG8(TCNT0)
+HOST_REG8(TCCR1A) HOST_REG8(TCCR1B) HOST_REG8(TCCR1C)
+HOST_REG16(OCR1A) HOST_REG16(OCR1B) HOST_REG16(ICR1) HOST_REG16(TCNT1)
+HOST_REG8(TIMSK1) HOST_REG8(TIFR1)
+HOST_REG8(TCCR2A) HOST_REG8(TCCR2B) HOST_REG8(OCR2A) HOST_REG8(OCR2B)
+HOST_REG8(TIMSK2) HOST_REG8(TIFR2) HOST_REG8(TCNT2)
+HOST_REG8(PCICR) HOST_REG8(PCIFR) HOST_REG8(PCMSK0) HOST_REG8(PCMSK1) HOST_REG8(PCMSK2)
+HOST_REG8(UCSR0A) HOST_REG8(UCSR0B) HOST_REG8(UCSR0C) HOST_REG8(UDR0) HOST_REG16(UBRR0)
+HOST_REG8(MCUSR)
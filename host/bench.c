@@ -0,0 +1,451 @@
+/* GPIB transfer benchmark on the host build.
+   Runs the firmware in a thread against the virtual bus and drives it
+   through the virtual UART the way a host program would. For each transfer
+   path and UART speed it prints the payload rate and the converter
+   handshake latency seen on the bus (struct vbus_stats) and the number of
+   command bytes sent with ATN.
+
+   The UART is paced at the selected baud rate, the firmware runs at host
+   speed, so the latency numbers are only comparable between host builds.
+   The socket between the bench and the firmware has no latency of its
+   own, unlike a USB serial adapter (about 1ms each way), so TBW, which
+   only saves the wait for the reply to each block, shows no gain over
+   TBD there. -l adds a modelled one-way link latency in microseconds.
+   TBW still keeps at most the UART RX ring (64 bytes) in flight, so with
+   latency its rate is bounded by the ring size over the round trip.
+
+   usage: bench [-n bytes] [-l us] [path...] */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "../uart.h"
+#include "host.h"
+#include "vbus.h"
+
+#define DEV_ADDR 23
+#define MY_ADDR 21
+
+void firmware_main(void);
+
+static int fd;
+static unsigned nbytes = 8192;
+static unsigned latency_us;
+static uint64_t t_done; /* end of the data, before the cleanup */
+static uint8_t pattern[16384];
+
+static void
+fail(const char *what)
+{
+ fprintf(stderr, "bench: %s\n", what);
+ exit(1);
+}
+
+static void
+put(const void *p, size_t len)
+{
+ if(write(fd, p, len) != (ssize_t)len) fail("write");
+}
+
+static void
+sendstr(const char *s)
+{
+ put(s, strlen(s));
+}
+
+static size_t
+recv_some(uint8_t *p, size_t len, int tmo_ms)
+{
+ struct pollfd pf = {fd, POLLIN, 0};
+ ssize_t n;
+
+ if(poll(&pf, 1, tmo_ms) <= 0) return 0;
+ n = read(fd, p, len);
+ return n > 0 ? n : 0;
+}
+
+static void
+recv_n(uint8_t *p, size_t len)
+{
+ size_t n;
+ while(len) {
+  n = recv_some(p, len, 2000);
+  if(!n) fail("receive timeout");
+  p += n;
+  len -= n;
+ }
+}
+
+static uint8_t
+recv_byte(void)
+{
+ uint8_t b;
+ recv_n(&b, 1);
+ return b;
+}
+
+/* reads until the input ends with s */
+static void
+expect(const char *s)
+{
+ char buf[256];
+ size_t l = strlen(s), n = 0;
+
+ while(n < l || memcmp(buf+n-l, s, l)) {
+  if(n == sizeof(buf)) {
+   memmove(buf, buf+n-l, l);
+   n = l;
+  }
+  buf[n++] = recv_byte();
+ }
+}
+
+/* discards the input until it's quiet for 50ms */
+static void
+drain(void)
+{
+ uint8_t buf[256];
+ while(recv_some(buf, sizeof(buf), 50));
+}
+
+static void
+cmd(const char *c)
+{
+ sendstr(c);
+ sendstr("\r");
+ expect("OK\r\n");
+}
+
+static void
+talk_to_dev(void)
+{
+ char c[8];
+ sprintf(c, "C%c%c", DEV_ADDR+32, MY_ADDR+64);
+ cmd(c);
+}
+
+static void
+listen_to_dev(void)
+{
+ char c[8];
+ sprintf(c, "C%c%c", DEV_ADDR+64, MY_ADDR+32);
+ cmd(c);
+}
+
+/* one direction of the modelled link: the data read from in is written
+   to out latency_us later */
+#define RELAY_CHUNKS 1024
+
+struct relay {
+ int in, out;
+ struct {
+  uint64_t due;
+  uint16_t len;
+  uint8_t data[512];
+ } q[RELAY_CHUNKS];
+};
+
+static void *
+relay_thread(void *arg)
+{
+ struct relay *r = arg;
+ struct pollfd pf = {r->in, POLLIN, 0};
+ unsigned wp = 0, rp = 0;
+ struct timespec ts, *tmo;
+ uint64_t now;
+ ssize_t n;
+
+ for(;;) {
+  now = host_time_ns();
+  while(rp != wp && r->q[rp].due <= now) {
+   if(write(r->out, r->q[rp].data, r->q[rp].len) != r->q[rp].len) fail("relay write");
+   rp = (rp+1) % RELAY_CHUNKS;
+  }
+  tmo = NULL;
+  if(rp != wp) {
+   ts.tv_sec = (r->q[rp].due-now)/1000000000;
+   ts.tv_nsec = (r->q[rp].due-now)%1000000000;
+   tmo = &ts;
+  }
+  pf.fd = (wp+1) % RELAY_CHUNKS == rp ? -1 : r->in; /* full, wait for the head */
+  if(ppoll(&pf, 1, tmo, NULL) <= 0) continue;
+  if((n = read(r->in, r->q[wp].data, sizeof(r->q[wp].data))) <= 0) fail("relay read");
+  r->q[wp].due = host_time_ns() + latency_us*1000ULL;
+  r->q[wp].len = n;
+  wp = (wp+1) % RELAY_CHUNKS;
+ }
+ return NULL;
+}
+
+/* peer is the far end of the bench socket, returns the descriptor for the
+   firmware end of the link */
+static int
+link_start(int peer)
+{
+ static struct relay up, down;
+ int sv[2];
+ pthread_t t;
+
+ if(!latency_us) return peer;
+ if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) fail("socketpair");
+ up.in = peer;
+ up.out = sv[0];
+ down.in = sv[0];
+ down.out = peer;
+ pthread_create(&t, NULL, relay_thread, &up);
+ pthread_create(&t, NULL, relay_thread, &down);
+ return sv[1];
+}
+
+/* transfer paths, each returns the payload size and sets t_done */
+
+static unsigned
+d_write(void)
+{
+ unsigned n, l;
+ uint8_t buf[64];
+
+ talk_to_dev();
+ for(n = 0; n < nbytes; n += l) {
+  l = nbytes-n > 60 ? 60 : nbytes-n;
+  buf[0] = 'D';
+  memcpy(buf+1, pattern+n, l);
+  buf[l+1] = '\r';
+  put(buf, l+2);
+  expect("OK\r\n");
+ }
+ t_done = host_time_ns();
+ return nbytes;
+}
+
+static unsigned
+tbd_write(int windowed)
+{
+ unsigned n = 0, l, win = 0, inflight = 0, q = 0, qh = 0;
+ uint8_t bs = 60, b, ql[64];
+
+ talk_to_dev();
+ if(windowed) {
+  sendstr("TBW\r");
+  win = recv_byte();
+  bs = win/2-1;
+  if(bs > 60) bs = 60;
+ } else sendstr("TBD\r");
+ while(n < nbytes || q != qh) {
+  if(n < nbytes) {
+   l = nbytes-n > bs ? bs : nbytes-n;
+   if(!windowed ? q == qh : inflight+l+1 <= win) {
+    b = l | (n+l == nbytes ? 0x80 : 0);
+    put(&b, 1);
+    put(pattern+n, l);
+    ql[q++ & 63] = l;
+    inflight += l+1;
+    n += l;
+    continue;
+   }
+  }
+  l = ql[qh++ & 63];
+  inflight -= l+1;
+  if(recv_byte() != l) fail("short write");
+ }
+ b = 0;
+ put(&b, 1);
+ t_done = host_time_ns();
+ return nbytes;
+}
+
+static unsigned tbd_write_plain(void) {return tbd_write(0);}
+static unsigned tbw_write(void) {return tbd_write(1);}
+
+static unsigned
+d_read(void)
+{
+ unsigned n;
+ uint8_t buf[4096];
+
+ vbus_dev_talk(pattern, sizeof(buf), 0);
+ listen_to_dev();
+ for(n = 0; n < nbytes; n += sizeof(buf)) {
+  sendstr("D\r");
+  recv_n(buf, sizeof(buf));
+  if(memcmp(buf, pattern, sizeof(buf))) fail("D read data");
+ }
+ t_done = host_time_ns();
+ return n;
+}
+
+static unsigned
+thd_read(void)
+{
+ unsigned n;
+ uint8_t buf[2*1024+2];
+
+ vbus_dev_talk(pattern, 1024, 0);
+ listen_to_dev();
+ for(n = 0; n < nbytes; n += 1024) {
+  sendstr("THD\r");
+  recv_n(buf, sizeof(buf));
+  if(buf[sizeof(buf)-1] != '\n') fail("THD read data");
+ }
+ t_done = host_time_ns();
+ return n;
+}
+
+static unsigned
+tbd_read(void)
+{
+ unsigned n = 0, l;
+ uint8_t buf[128];
+
+ vbus_dev_talk(pattern, 4096, 0);
+ listen_to_dev();
+ while(n < nbytes) {
+  sendstr("TBD\r");
+  while((l = recv_byte()) != 0) {
+   recv_n(buf, l & 0x7f);
+   n += l & 0x7f;
+  }
+ }
+ t_done = host_time_ns();
+ return n;
+}
+
+static unsigned
+p_read(void)
+{
+ unsigned n;
+ uint8_t buf[256];
+
+ vbus_dev_talk(pattern, 256, 1);
+ listen_to_dev();
+ sendstr("P\r");
+ for(n = 0; n < nbytes; n += sizeof(buf)) recv_n(buf, sizeof(buf));
+ t_done = host_time_ns();
+ sendstr("\033");
+ drain();
+ vbus_dev_talk(NULL, 0, 0);
+ return n;
+}
+
+static unsigned
+px_read(void)
+{
+ unsigned n;
+ uint8_t buf[4096];
+ char c[32];
+
+ vbus_dev_talk(pattern, sizeof(buf), 0);
+ sprintf(c, "++addr %u\r", DEV_ADDR);
+ sendstr(c);
+ for(n = 0; n < nbytes; n += sizeof(buf)) {
+  sendstr("++read eoi\r");
+  recv_n(buf, sizeof(buf));
+  if(memcmp(buf, pattern, sizeof(buf))) fail("++read data");
+ }
+ t_done = host_time_ns();
+ sendstr("++exit\r");
+ drain();
+ return n;
+}
+
+static const struct {
+ const char *name;
+ unsigned (*run)(void);
+} paths[] = {
+ {"D-write", d_write},
+ {"TBD-write", tbd_write_plain},
+ {"TBW-write", tbw_write},
+ {"D-read", d_read},
+ {"THD-read", thd_read},
+ {"TBD-read", tbd_read},
+ {"P-read", p_read},
+ {"++read", px_read},
+};
+
+static const struct {
+ uint8_t opt;
+ unsigned baud;
+} speeds[] = {
+ {UART_115200, 115200},
+ {UART_500K, 500000},
+ {UART_1M, 1000000},
+ {UART_2M, 2000000},
+};
+
+static void *
+firmware_thread(void *arg)
+{
+ firmware_main();
+ return NULL;
+}
+
+static int
+selected(int argc, char **argv, const char *name)
+{
+ int i;
+ if(argc == 0) return 1;
+ for(i = 0; i < argc; i++) if(!strcmp(argv[i], name)) return 1;
+ return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+ int sv[2], opt;
+ unsigned i, j, n;
+ char c[16];
+ pthread_t t;
+ uint64_t t0, t1;
+ struct vbus_stats st;
+
+ while((opt = getopt(argc, argv, "n:l:")) != -1) {
+  if(opt == 'n') nbytes = atoi(optarg);
+  else if(opt == 'l') latency_us = atoi(optarg);
+  else {
+   fprintf(stderr, "usage: bench [-n bytes] [-l us] [path...]\n");
+   return 1;
+  }
+ }
+ argc -= optind;
+ argv += optind;
+ for(i = 0; i < sizeof(pattern); i++) pattern[i] = 'A' + i%26;
+
+ if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) fail("socketpair");
+ fd = sv[0];
+ sprintf(c, "%d", link_start(sv[1]));
+ setenv("UART_FD", c, 1);
+ setenv("VBUS_ADDR", "23", 1);
+ pthread_create(&t, NULL, firmware_thread, NULL);
+
+ drain();
+ sendstr("\r");
+ cmd("O1");
+ drain();
+
+ printf("%-10s %8s %8s %10s %9s %9s %6s\n",
+        "path", "baud", "bytes", "bytes/s", "hs avg us", "hs max us", "atn");
+ for(j = 0; j < sizeof(speeds)/sizeof(speeds[0]); j++) {
+  sprintf(c, "OB%u", speeds[j].opt);
+  cmd(c);
+  usleep(3000);
+  for(i = 0; i < sizeof(paths)/sizeof(paths[0]); i++) {
+   if(!selected(argc, argv, paths[i].name)) continue;
+   vbus_get_stats(&st, 1);
+   t0 = host_time_ns();
+   n = paths[i].run();
+   t1 = t_done;
+   vbus_get_stats(&st, 1);
+   printf("%-10s %8u %8u %10.0f %9.2f %9.2f %6u\n", paths[i].name, speeds[j].baud, n,
+          n*1e9/(t1-t0), st.hs_count ? st.hs_ns/1e3/st.hs_count : 0.0,
+          st.hs_max_ns/1e3, st.cmd_bytes);
+   fflush(stdout);
+  }
+ }
+ return 0;
+}
@@ -0,0 +1,57 @@
+/* Framed mode encoding, see frame.h */
+#include <string.h>
+
+#include "frame.h"
+
+/* CRC-16/XMODEM, sent LE */
+uint16_t
+frame_crc(uint16_t crc, const uint8_t *p, unsigned len)
+{
+ uint8_t i;
+ while(len--) {
+  crc ^= (uint16_t)*p++ << 8;
+  for(i = 0; i < 8; i++) crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+ }
+ return crc;
+}
+
+unsigned
+frame_put(uint8_t *out, uint8_t op, uint8_t seq, int st, const uint8_t *p, uint8_t len)
+{
+ unsigned n = 0;
+ uint16_t crc;
+
+ out[n++] = FRM_SYN;
+ out[n++] = op;
+ out[n++] = seq;
+ if(st >= 0) out[n++] = st;
+ out[n++] = len;
+ if(len) memcpy(out+n, p, len);
+ n += len;
+ crc = frame_crc(0, out+1, n-1);
+ out[n++] = crc;
+ out[n++] = crc >> 8;
+ return n;
+}
+
+unsigned
+frame_get(const uint8_t *buf, unsigned n, int resp, struct frame *f)
+{
+ unsigned h = resp ? FRM_HDR_RESP : FRM_HDR_REQ, size;
+
+ if(n < h) return 0;
+ f->op = buf[1];
+ f->seq = buf[2];
+ f->st = resp ? buf[3] : 0;
+ f->len = buf[h-1];
+ f->data = buf+h;
+ f->bad = 0;
+ if(!resp && f->len > FRM_REQ_MAX) {
+  f->bad = 1;
+  return h;
+ }
+ size = h+f->len+2;
+ if(n < size) return 0;
+ f->bad = frame_crc(0, buf+1, size-3) != (buf[size-2] | buf[size-1] << 8);
+ return size;
+}
@@ -0,0 +1,28 @@
+#pragma once
+/* Frames of the converter's framed mode (F command, see framed_loop() in
+   hp3478-ext.c), for the host side programs. */
+#include <stdint.h>
+
+#define FRM_SYN 0xa5
+#define FRM_ST_OK 0
+#define FRM_ST_TIMEOUT 1
+#define FRM_ST_ERROR 2
+#define FRM_ST_CRC 3
+#define FRM_REQ_MAX 64 /* request data, CMD_BUF_SIZE of the firmware */
+#define FRM_HDR_REQ 4  /* sync, op, seq, len */
+#define FRM_HDR_RESP 5 /* sync, op, seq, st, len */
+#define FRM_MAX (FRM_HDR_RESP+255+2)
+
+struct frame {
+ uint8_t op, seq, st, len;
+ uint8_t bad; /* CRC error or a request over FRM_REQ_MAX */
+ const uint8_t *data;
+};
+
+uint16_t frame_crc(uint16_t crc, const uint8_t *p, unsigned len);
+/* writes a request (st < 0) or a response to out, returns its size */
+unsigned frame_put(uint8_t *out, uint8_t op, uint8_t seq, int st, const uint8_t *p, uint8_t len);
+/* parses the request (resp = 0) or the response at buf[0] == FRM_SYN;
+   returns its size or 0 if it's incomplete. A bad request's size only
+   covers the header if the length is invalid. */
+unsigned frame_get(const uint8_t *buf, unsigned n, int resp, struct frame *f);
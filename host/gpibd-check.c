@@ -0,0 +1,247 @@
+/* Check of gpibd's addressing with two clients.
+   Starts the simulator on a pty and gpibd on it, then two clients take
+   turns with the simulated device (an echo device, see vbus.h). Each
+   client relies on its own last C request, so gpibd must restore it
+   before the client's D and R requests. An addressing already on the bus
+   must be answered from the cache, a C request with other commands after
+   the address bytes (PPC, PPE) must reach the converter and must not
+   leave them in the client's addressing.
+
+   usage: gpibd-check, from the directory of hp3478-ext-sim and gpibd
+     make -C host check */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "frame.h"
+
+#define DEV_ADDR 23
+#define TMO_MS 5000
+
+struct client {
+ int fd;
+ uint8_t seq;
+ uint8_t in[2*FRM_MAX];
+ unsigned len;
+};
+
+struct resp {
+ uint8_t st, len;
+ uint8_t data[255];
+};
+
+static pid_t sim_pid, gpibd_pid;
+static char pty[64], sock[64];
+static uint8_t my_addr;
+
+static void
+cleanup(void)
+{
+ if(gpibd_pid > 0) kill(gpibd_pid, SIGTERM);
+ if(sim_pid > 0) kill(sim_pid, SIGTERM);
+ unlink(sock);
+ unlink(pty);
+}
+
+static void
+fail(const char *what)
+{
+ fprintf(stderr, "gpibd-check: %s\n", what);
+ exit(1);
+}
+
+static pid_t
+spawn(char *const argv[], int err_fd)
+{
+ pid_t pid = fork();
+
+ if(pid < 0) fail("fork");
+ if(pid == 0) {
+  if(err_fd >= 0) dup2(err_fd, 2);
+  execv(argv[0], argv);
+  _exit(127);
+ }
+ return pid;
+}
+
+static int
+connect_unix(const char *path)
+{
+ struct sockaddr_un a;
+ int fd, i;
+
+ memset(&a, 0, sizeof(a));
+ a.sun_family = AF_UNIX;
+ strcpy(a.sun_path, path);
+ /* gpibd listens once it has opened the port */
+ for(i = 0; i < TMO_MS/10; i++) {
+  if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) fail("socket");
+  if(!connect(fd, (struct sockaddr *)&a, sizeof(a))) return fd;
+  close(fd);
+  usleep(10000);
+ }
+ fail("can't connect to gpibd");
+ return -1;
+}
+
+static struct resp
+request(struct client *c, uint8_t op, const void *p, uint8_t len)
+{
+ uint8_t b[FRM_HDR_REQ+FRM_REQ_MAX+2];
+ struct pollfd pf = {c->fd, POLLIN, 0};
+ struct frame f;
+ struct resp r;
+ unsigned n;
+ ssize_t l;
+
+ n = frame_put(b, op, ++c->seq, -1, p, len);
+ if(write(c->fd, b, n) != (ssize_t)n) fail("write");
+ while(!c->len || !(n = frame_get(c->in, c->len, 1, &f))) {
+  if(c->len && c->in[0] != FRM_SYN) fail("no sync byte");
+  if(poll(&pf, 1, TMO_MS) <= 0) fail("response timeout");
+  if((l = read(c->fd, c->in+c->len, sizeof(c->in)-c->len)) <= 0) fail("gpibd closed the connection");
+  c->len += l;
+ }
+ if(f.bad || f.op != op || f.seq != c->seq) fail("bad response");
+ r.st = f.st;
+ r.len = f.len;
+ memcpy(r.data, f.data, f.len);
+ memmove(c->in, c->in+n, c->len-n);
+ c->len -= n;
+ return r;
+}
+
+static struct resp
+ok(struct client *c, uint8_t op, const void *p, uint8_t len, const char *what)
+{
+ struct resp r = request(c, op, p, len);
+ if(r.st != FRM_ST_OK) fail(what);
+ return r;
+}
+
+/* the converter talks, the device listens */
+static void
+addr_talk(struct client *c)
+{
+ uint8_t a[3] = {'?', DEV_ADDR+0x20, my_addr+0x40};
+ ok(c, 'C', a, 3, "talk addressing");
+}
+
+static void
+addr_listen(struct client *c)
+{
+ uint8_t a[3] = {'?', DEV_ADDR+0x40, my_addr+0x20};
+ ok(c, 'C', a, 3, "listen addressing");
+}
+
+/* ends with EOI, the device takes it as a message */
+static void
+dev_send(struct client *c, const char *s)
+{
+ uint8_t b[FRM_REQ_MAX];
+
+ b[0] = 4; /* GPIB_END_EOI */
+ memcpy(b+1, s, strlen(s));
+ ok(c, 'D', b, strlen(s)+1, "send");
+}
+
+static void
+dev_recv(struct client *c, const char *s)
+{
+ struct resp r = ok(c, 'R', NULL, 0, "receive");
+ if(r.len != strlen(s)+1 || memcmp(r.data+1, s, strlen(s))) {
+  fprintf(stderr, "gpibd-check: expected \"%s\", got \"%.*s\"\n", s, r.len ? r.len-1 : 0, r.data+1);
+  exit(1);
+ }
+}
+
+int
+main(int argc, char **argv)
+{
+ char *sim_argv[] = {"./hp3478-ext-sim", NULL};
+ char *gpibd_argv[] = {"./gpibd", "-s", sock, pty, NULL};
+ struct client a = {0}, b = {0};
+ struct resp r;
+ uint8_t ren = 1, pp[5];
+ unsigned sent, cached;
+ char line[512];
+ int pfd[2], i;
+ FILE *f;
+
+ snprintf(pty, sizeof(pty), "/tmp/gpibd-check.%d.pty", (int)getpid());
+ snprintf(sock, sizeof(sock), "/tmp/gpibd-check.%d.sock", (int)getpid());
+ atexit(cleanup);
+ setenv("UART_PTY", pty, 1);
+ setenv("VBUS_ADDR", "23", 1);
+ sim_pid = spawn(sim_argv, -1);
+ for(i = 0; access(pty, F_OK); i++) {
+  if(i == TMO_MS/10) fail("the simulator's pty didn't appear");
+  usleep(10000);
+ }
+ /* gpibd prints its counters to stderr when it exits */
+ if(pipe(pfd)) fail("pipe");
+ gpibd_pid = spawn(gpibd_argv, pfd[1]);
+ close(pfd[1]);
+ a.fd = connect_unix(sock);
+ b.fd = connect_unix(sock);
+
+ ok(&a, 'E', &ren, 1, "REN");
+ r = ok(&a, 'O', "C", 1, "option C");
+ my_addr = r.data[0];
+
+ addr_talk(&a);
+ dev_send(&a, "*IDN?");
+ addr_listen(&a);
+ dev_recv(&a, "HP3478EXT,VBUS,0,0\n");
+
+ /* the same addressing as on the bus: cached (1) */
+ addr_listen(&b);
+ addr_talk(&b);
+ dev_send(&b, "hello");
+ /* A's listen addressing comes back */
+ dev_recv(&a, "hello");
+ /* cached (2) */
+ addr_listen(&a);
+ /* B's talk addressing comes back, the converter would reject D while
+    it listens */
+ dev_send(&b, "cd");
+ dev_recv(&a, "cd");
+
+ /* PPE after PPC isn't a secondary address */
+ pp[0] = '?';
+ pp[1] = DEV_ADDR+0x20;
+ pp[2] = my_addr+0x40;
+ pp[3] = 0x05; /* PPC */
+ pp[4] = 0x60; /* PPE, line 1 */
+ ok(&b, 'C', pp, 5, "PPC/PPE");
+ /* the addresses of the PPE request are on the bus: cached (3) */
+ addr_talk(&b);
+ dev_send(&b, "pp");
+ dev_recv(&a, "pp");
+ dev_send(&b, "x");
+ dev_recv(&a, "x");
+
+ close(a.fd);
+ close(b.fd);
+ kill(gpibd_pid, SIGTERM);
+ gpibd_pid = 0;
+ if(!(f = fdopen(pfd[0], "r"))) fail("fdopen");
+ sent = cached = ~0u;
+ while(fgets(line, sizeof(line), f)) {
+  if(sscanf(line, "gpibd: %u requests sent, %u answered from the cache", &sent, &cached) != 2)
+   fputs(line, stderr);
+ }
+ if(cached != 3) {
+  fprintf(stderr, "gpibd-check: %u requests answered from the cache, expected 3\n", cached);
+  return 1;
+ }
+ printf("gpibd-check: ok, %u requests sent, %u answered from the cache\n", sent, cached);
+ return 0;
+}
@@ -0,0 +1,504 @@
+/* GPIB bridge daemon.
+   Owns the serial link to the converter and shares it between local
+   programs. The converter is switched to the selected baud rate and to the
+   framed mode (F command); clients connect to a Unix socket and send framed
+   mode requests (see frame.h) with their own sequence numbers.
+
+   The requests of all clients are sent in arrival order and pipelined up to
+   the size of the converter's UART receive ring (-w). Each response goes
+   back to its client with the client's sequence number.
+
+   A client's addressing is the address bytes of its last C request. Before
+   the client's next D or R request, or a C request without address bytes
+   (SDC, GET...), the addressing is sent again if another client changed it.
+   A C request with only the address bytes already on the bus and an E
+   request that doesn't change REN are answered without the converter, so
+   clients can address the device before each transaction for free.
+   X is answered locally and O can't change the baud rate.
+
+   With the simulator as the converter:
+     UART_PTY=/tmp/hp3478ext host/hp3478-ext-sim &
+     host/gpibd -s /tmp/gpibd.sock /tmp/hp3478ext
+
+   usage: gpibd [-v] [-b baud] [-w window] [-t timeout ms] [-s socket] port */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "frame.h"
+#include "link.h"
+
+#define CLIENTS 16
+#define QUEUE 256 /* requests, both waiting and sent */
+#define NO_CTX 0xff
+
+struct client {
+ int fd;
+ unsigned id; /* 0 if the slot is free */
+ uint8_t in[FRM_HDR_REQ+FRM_REQ_MAX+2];
+ unsigned in_len;
+ uint8_t ctx[FRM_REQ_MAX], ctx_len;
+};
+
+struct req {
+ unsigned client; /* id, 0 for the addressing sent by the daemon */
+ uint8_t op, cseq, len;
+ uint8_t data[FRM_REQ_MAX];
+ uint8_t local; /* answered with st and data without the converter */
+ uint8_t st;
+ uint8_t seq;   /* sent to the converter */
+ uint8_t size;  /* of the frame */
+ uint64_t t;    /* time sent */
+};
+
+static int ser_fd, verbose;
+static unsigned window = 63, timeout = 10000;
+static struct client clients[CLIENTS];
+static unsigned client_next_id = 1;
+
+/* received requests, then the ones sent in the converter's order */
+static struct req wq[QUEUE], sq[QUEUE];
+static unsigned wq_rp, wq_wp, sq_rp, sq_wp;
+static unsigned inflight; /* bytes sent and not answered */
+static uint8_t seq_next;
+
+/* the state of the bus after the requests sent so far */
+static uint8_t bus_ctx[FRM_REQ_MAX], bus_ctx_len = NO_CTX;
+static int bus_ren = -1;
+static unsigned stat_req, stat_cached;
+static volatile sig_atomic_t sig_got;
+
+static void
+fail(const char *what)
+{
+ fprintf(stderr, "gpibd: %s\n", what);
+ exit(1);
+}
+
+static uint64_t
+now_ms(void)
+{
+ struct timespec t;
+ clock_gettime(CLOCK_MONOTONIC, &t);
+ return t.tv_sec*1000ULL + t.tv_nsec/1000000;
+}
+
+static void
+ser_put(const void *p, size_t len)
+{
+ if(link_write(ser_fd, p, len)) fail("serial write");
+}
+
+static struct client *
+client_get(unsigned id)
+{
+ unsigned i;
+ if(!id) return NULL;
+ for(i = 0; i < CLIENTS; i++) if(clients[i].id == id) return &clients[i];
+ return NULL;
+}
+
+static void
+client_close(struct client *cl)
+{
+ if(verbose) fprintf(stderr, "gpibd: client %u closed\n", cl->id);
+ close(cl->fd);
+ cl->id = 0;
+}
+
+static void
+client_reply(unsigned id, uint8_t op, uint8_t seq, uint8_t st, const uint8_t *p, uint8_t len)
+{
+ struct client *cl = client_get(id);
+ uint8_t f[FRM_MAX];
+ unsigned n;
+
+ if(!cl) return;
+ n = frame_put(f, op, seq, st, p, len);
+ if(send(cl->fd, f, n, MSG_NOSIGNAL) != (ssize_t)n) client_close(cl);
+}
+
+static void
+sq_push(struct req *r)
+{
+ sq[sq_wp++ % QUEUE] = *r;
+}
+
+static void
+send_req(struct req *r)
+{
+ uint8_t f[FRM_MAX];
+
+ r->local = 0;
+ r->seq = seq_next++;
+ r->size = frame_put(f, r->op, r->seq, -1, r->data, r->len);
+ r->t = now_ms();
+ ser_put(f, r->size);
+ inflight += r->size;
+ sq_push(r);
+ if(verbose) fprintf(stderr, "gpibd: %u: %c %u\n", r->client, r->op, r->len);
+}
+
+static void
+local_reply(struct req *r, uint8_t st, uint8_t len)
+{
+ r->local = 1;
+ r->st = st;
+ r->len = len;
+ sq_push(r);
+ if(verbose) fprintf(stderr, "gpibd: %u: %c local\n", r->client, r->op);
+}
+
+/* answers the local requests that aren't behind a sent one */
+static void
+flush_local(void)
+{
+ struct req *r;
+ while(sq_rp != sq_wp && (r = &sq[sq_rp % QUEUE])->local) {
+  client_reply(r->client, r->op, r->cseq, r->st, r->data, r->len);
+  sq_rp++;
+ }
+}
+
+/* the address bytes of a command, *pure = 0 if there are other bytes:
+   the listen and talk addresses, UNL and UNT, and a secondary address
+   right after a primary one (the same range also holds PPE and PPD) */
+static uint8_t
+addr_bytes(const uint8_t *p, uint8_t len, uint8_t *a, int *pure)
+{
+ uint8_t i, n = 0;
+ *pure = 1;
+ for(i = 0; i < len; i++) {
+  if(p[i] >= 0x20 && p[i] < 0x60) a[n++] = p[i];
+  else if(p[i] >= 0x60 && p[i] < 0x7f && i && p[i-1] >= 0x20 && p[i-1] < 0x5f
+          && p[i-1] != 0x3f) a[n++] = p[i];
+  else *pure = 0;
+ }
+ return n;
+}
+
+static int
+fits(unsigned size)
+{
+ return !inflight || inflight+size <= window;
+}
+
+/* moves the waiting requests to the converter or answers them locally */
+static void
+pump(void)
+{
+ struct req *r, c;
+ struct client *cl;
+ uint8_t a[FRM_REQ_MAX], n;
+ int pure;
+
+ while(wq_rp != wq_wp && sq_wp-sq_rp < QUEUE) {
+  r = &wq[wq_rp % QUEUE];
+  if(!(cl = client_get(r->client))) {
+   wq_rp++;
+   continue;
+  }
+  n = 0;
+  pure = 0;
+  if(r->op == 'C') n = addr_bytes(r->data, r->len, a, &pure);
+  if((r->op == 'D' || r->op == 'R' || (r->op == 'C' && !n)) && cl->ctx_len != NO_CTX
+     && (bus_ctx_len != cl->ctx_len || memcmp(bus_ctx, cl->ctx, cl->ctx_len))) {
+   /* restore the client's addressing first */
+   if(!fits(FRM_HDR_REQ+cl->ctx_len+2)) break;
+   memset(&c, 0, sizeof(c));
+   c.op = 'C';
+   c.len = cl->ctx_len;
+   memcpy(c.data, cl->ctx, c.len);
+   send_req(&c);
+   memcpy(bus_ctx, cl->ctx, cl->ctx_len);
+   bus_ctx_len = cl->ctx_len;
+   continue;
+  }
+  switch(r->op) {
+          case 'C':
+                  if(!n) break;
+                  memcpy(cl->ctx, a, n);
+                  cl->ctx_len = n;
+                  if(pure && bus_ctx_len == n && !memcmp(bus_ctx, a, n)) {
+                   stat_cached++;
+                   r->data[0] = r->len;
+                   local_reply(r, FRM_ST_OK, 1);
+                   wq_rp++;
+                   continue;
+                  }
+                  if(!fits(FRM_HDR_REQ+r->len+2)) goto full;
+                  memcpy(bus_ctx, a, n);
+                  bus_ctx_len = n;
+                  break;
+          case 'E':
+                  if(r->len == 1 && r->data[0] == bus_ren) {
+                   stat_cached++;
+                   local_reply(r, FRM_ST_OK, 0);
+                   wq_rp++;
+                   continue;
+                  }
+                  if(!fits(FRM_HDR_REQ+r->len+2)) goto full;
+                  bus_ren = r->len == 1 && r->data[0] <= 1 ? r->data[0] : -1;
+                  break;
+          case 'O':
+                  if(r->len && (r->data[0] == 'B' || r->data[0] == 'u')) {
+                   local_reply(r, FRM_ST_ERROR, 0);
+                   wq_rp++;
+                   continue;
+                  }
+                  break;
+          case 'X':
+          case 'F':
+                  local_reply(r, FRM_ST_OK, 0);
+                  wq_rp++;
+                  continue;
+  }
+  if(!fits(FRM_HDR_REQ+r->len+2)) break;
+  send_req(r);
+  wq_rp++;
+ }
+full:
+ flush_local();
+}
+
+/* a sent request is answered, or lost if f is NULL */
+static void
+complete(struct req *r, const struct frame *f)
+{
+ inflight -= r->size;
+ stat_req++;
+ if(!f || f->st != FRM_ST_OK) {
+  if(r->op == 'C') bus_ctx_len = NO_CTX;
+  if(r->op == 'E') bus_ren = -1;
+ }
+ if(!f) client_reply(r->client, r->op, r->cseq, FRM_ST_TIMEOUT, 0, 0);
+ else client_reply(r->client, r->op, r->cseq, f->st, f->data, f->len);
+}
+
+static void
+converter_reply(const struct frame *f)
+{
+ unsigned i;
+ struct req *r;
+
+ for(i = sq_rp; i != sq_wp; i++) if(!sq[i % QUEUE].local && sq[i % QUEUE].seq == f->seq) break;
+ if(i == sq_wp) {
+  if(verbose) fprintf(stderr, "gpibd: unexpected response %c seq %u\n", f->op, f->seq);
+  return;
+ }
+ /* the ones before it were lost */
+ while(sq_rp != i) {
+  r = &sq[sq_rp++ % QUEUE];
+  if(r->local) client_reply(r->client, r->op, r->cseq, r->st, r->data, r->len);
+  else complete(r, NULL);
+ }
+ complete(&sq[sq_rp++ % QUEUE], f);
+ flush_local();
+}
+
+static void
+serial_input(void)
+{
+ static uint8_t buf[2*FRM_MAX];
+ static unsigned n;
+ unsigned p = 0, l;
+ ssize_t r;
+ struct frame f;
+
+ r = read(ser_fd, buf+n, sizeof(buf)-n);
+ if(r <= 0) fail("serial read");
+ n += r;
+ while(p < n) {
+  if(buf[p] != FRM_SYN) {
+   p++;
+   continue;
+  }
+  if(!(l = frame_get(buf+p, n-p, 1, &f))) break;
+  if(f.bad) {
+   /* the length may be wrong too, resync from the next byte */
+   p++;
+   continue;
+  }
+  converter_reply(&f);
+  p += l;
+ }
+ memmove(buf, buf+p, n-p);
+ n -= p;
+}
+
+/* queues the frames buffered from a client, as many as fit */
+static void
+client_parse(struct client *cl)
+{
+ unsigned p = 0, l;
+ struct frame f;
+ struct req *q;
+
+ while(p < cl->in_len && wq_wp-wq_rp < QUEUE) {
+  if(cl->in[p] != FRM_SYN) {
+   p++;
+   continue;
+  }
+  if(!(l = frame_get(cl->in+p, cl->in_len-p, 0, &f))) break;
+  p += l;
+  if(f.bad) {
+   client_reply(cl->id, f.op, f.seq, FRM_ST_CRC, 0, 0);
+   continue;
+  }
+  q = &wq[wq_wp++ % QUEUE];
+  q->client = cl->id;
+  q->op = f.op;
+  q->cseq = f.seq;
+  q->len = f.len;
+  memcpy(q->data, f.data, f.len);
+ }
+ memmove(cl->in, cl->in+p, cl->in_len-p);
+ cl->in_len -= p;
+}
+
+static void
+client_input(struct client *cl)
+{
+ ssize_t r;
+
+ /* the frames left by a full queue go first, they make room */
+ client_parse(cl);
+ if(cl->in_len == sizeof(cl->in)) return;
+ r = read(cl->fd, cl->in+cl->in_len, sizeof(cl->in)-cl->in_len);
+ if(r <= 0) {
+  client_close(cl);
+  return;
+ }
+ cl->in_len += r;
+ client_parse(cl);
+}
+
+static void
+client_accept(int lfd)
+{
+ int fd = accept(lfd, NULL, NULL);
+ unsigned i;
+
+ if(fd < 0) return;
+ for(i = 0; i < CLIENTS && clients[i].id; i++);
+ if(i == CLIENTS) {
+  close(fd);
+  return;
+ }
+ clients[i].fd = fd;
+ clients[i].id = client_next_id++;
+ clients[i].in_len = 0;
+ clients[i].ctx_len = NO_CTX;
+ if(verbose) fprintf(stderr, "gpibd: client %u\n", clients[i].id);
+}
+
+static int
+listen_unix(const char *path)
+{
+ struct sockaddr_un a;
+ int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+ if(fd < 0 || strlen(path) >= sizeof(a.sun_path)) fail("socket");
+ memset(&a, 0, sizeof(a));
+ a.sun_family = AF_UNIX;
+ strcpy(a.sun_path, path);
+ unlink(path);
+ if(bind(fd, (struct sockaddr *)&a, sizeof(a)) || listen(fd, 4)) fail(path);
+ return fd;
+}
+
+static void
+on_signal(int sig)
+{
+ sig_got = sig;
+}
+
+int
+main(int argc, char **argv)
+{
+ const char *sock = "/tmp/hp3478ext.sock";
+ unsigned baud = 2000000, i, n, map[CLIENTS];
+ struct pollfd pf[CLIENTS+2];
+ struct timespec ts;
+ sigset_t sigs, unblocked;
+ int opt, lfd;
+ uint64_t t;
+
+ while((opt = getopt(argc, argv, "vb:w:t:s:")) != -1) {
+  switch(opt) {
+          case 'v': verbose = 1; break;
+          case 'b': baud = atoi(optarg); break;
+          case 'w': window = atoi(optarg); break;
+          case 't': timeout = atoi(optarg); break;
+          case 's': sock = optarg; break;
+          default: optind = argc+1;
+  }
+ }
+ if(optind != argc-1) {
+  fprintf(stderr, "usage: gpibd [-v] [-b baud] [-w window] [-t timeout ms] [-s socket] port\n");
+  return 1;
+ }
+
+ if((ser_fd = link_open(argv[optind], baud)) < 0) fail(link_error);
+ lfd = listen_unix(sock);
+ signal(SIGUSR1, on_signal);
+ signal(SIGINT, on_signal);
+ signal(SIGTERM, on_signal);
+ /* taken only in ppoll(), so a signal can't come just before it */
+ sigemptyset(&sigs);
+ sigaddset(&sigs, SIGUSR1);
+ sigaddset(&sigs, SIGINT);
+ sigaddset(&sigs, SIGTERM);
+ sigprocmask(SIG_BLOCK, &sigs, &unblocked);
+ if(verbose) fprintf(stderr, "gpibd: %s at %u, clients on %s\n", argv[optind], baud, sock);
+
+ for(;;) {
+  /* the frames left in the clients' buffers by a full queue */
+  for(i = 0; i < CLIENTS; i++) if(clients[i].id && clients[i].in_len) client_parse(&clients[i]);
+  pump();
+  pf[0] = (struct pollfd){ser_fd, POLLIN, 0};
+  pf[1] = (struct pollfd){lfd, POLLIN, 0};
+  n = 2;
+  /* stop reading the clients while the queue is full */
+  if(wq_wp-wq_rp < QUEUE) {
+   for(i = 0; i < CLIENTS; i++) {
+    if(!clients[i].id) continue;
+    map[n-2] = i;
+    pf[n++] = (struct pollfd){clients[i].fd, POLLIN, 0};
+   }
+  }
+  if(sq_rp != sq_wp) {
+   t = sq[sq_rp % QUEUE].t + timeout;
+   t = t > now_ms() ? t-now_ms() : 0;
+   ts.tv_sec = t/1000;
+   ts.tv_nsec = t%1000*1000000;
+  }
+  if(ppoll(pf, n, sq_rp != sq_wp ? &ts : NULL, &unblocked) < 0) {
+   if(!sig_got) continue;
+   fprintf(stderr, "gpibd: %u requests sent, %u answered from the cache\n", stat_req, stat_cached);
+   if(sig_got != SIGUSR1) break;
+   sig_got = 0;
+   continue;
+  }
+  if(sq_rp != sq_wp && now_ms() >= sq[sq_rp % QUEUE].t + timeout) {
+   /* the converter may be stuck in a transfer: unknown bus state */
+   complete(&sq[sq_rp++ % QUEUE], NULL);
+   bus_ctx_len = NO_CTX;
+   bus_ren = -1;
+   flush_local();
+  }
+  if(pf[0].revents) serial_input();
+  if(pf[1].revents) client_accept(lfd);
+  for(i = 2; i < n; i++) if(pf[i].revents && clients[map[i-2]].id) client_input(&clients[map[i-2]]);
+ }
+ unlink(sock);
+ return 0;
+}
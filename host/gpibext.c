@@ -0,0 +1,505 @@
+/* Host library for the converter, see gpibext.h */
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include "frame.h"
+#include "link.h"
+#include "gpibext.h"
+
+#define END_BUF 8  /* GPIB_END_BUF: an R request stopped at its limit */
+#define R_MAX 254  /* bytes per R request */
+#define WINDOW 63  /* the converter's UART receive ring less one byte */
+#define ADDR_UNKNOWN (-1)
+
+struct op {
+ struct op *next;
+ int id;
+ unsigned max;    /* recv, 0 = until the end */
+ unsigned frames; /* not answered */
+ uint8_t done;
+ struct gpibext_result r;
+ uint8_t *data;
+ unsigned cap;
+};
+
+struct frm {
+ struct frm *next;
+ struct op *op;
+ uint8_t code, seq, len;
+ uint8_t data[FRM_REQ_MAX];
+};
+
+struct gpibext {
+ int fd;
+ uint8_t my_addr;
+ unsigned window, tmo;
+ int addr; /* dev << 1 | 1 if the converter listens */
+ int ren;
+ int id_next;
+ uint8_t seq_next;
+ struct op *ops, *ops_last; /* not completed yet */
+ struct op *ret;            /* returned by the last gpibext_complete() */
+ struct frm *out, *out_last;
+ struct frm *sent, *sent_last;
+ unsigned inflight;
+ struct op *barrier; /* a recv that may need another R request */
+ uint8_t in[2*FRM_MAX];
+ unsigned in_len;
+ char err[128];
+};
+
+static void
+set_err(struct gpibext *g, const char *s)
+{
+ snprintf(g->err, sizeof(g->err), "%s", s);
+}
+
+static struct op *
+op_new(struct gpibext *g)
+{
+ struct op *op = calloc(1, sizeof(*op));
+ if(!op) return NULL;
+ op->id = g->id_next++;
+ if(g->id_next <= 0) g->id_next = 1;
+ if(g->ops_last) g->ops_last->next = op;
+ else g->ops = op;
+ g->ops_last = op;
+ return op;
+}
+
+static void
+op_status(struct op *op, int st)
+{
+ if(op->r.st == GPIBEXT_OK) op->r.st = st;
+}
+
+static int
+op_append(struct op *op, const uint8_t *p, unsigned len)
+{
+ uint8_t *d;
+ if(op->r.len+len > op->cap) {
+  if(!(d = realloc(op->data, op->cap*2+len))) return -1;
+  op->data = d;
+  op->cap = op->cap*2+len;
+ }
+ memcpy(op->data+op->r.len, p, len);
+ op->r.len += len;
+ return 0;
+}
+
+static struct frm *
+frm_new(struct op *op, uint8_t code, const void *p, uint8_t len)
+{
+ struct frm *f = malloc(sizeof(*f));
+ if(!f) return NULL;
+ f->next = NULL;
+ f->op = op;
+ f->code = code;
+ f->len = len;
+ memcpy(f->data, p, len);
+ op->frames++;
+ return f;
+}
+
+static int
+queue(struct gpibext *g, struct op *op, uint8_t code, const void *p, uint8_t len)
+{
+ struct frm *f = frm_new(op, code, p, len);
+ if(!f) {
+  set_err(g, "out of memory");
+  return -1;
+ }
+ if(g->out_last) g->out_last->next = f;
+ else g->out = f;
+ g->out_last = f;
+ return 0;
+}
+
+static int
+queue_ren(struct gpibext *g, struct op *op, int on)
+{
+ uint8_t v = on;
+ if(g->ren == on) return 0;
+ g->ren = on;
+ return queue(g, op, 'E', &v, 1);
+}
+
+static int
+queue_addr(struct gpibext *g, struct op *op, uint8_t dev, int listen)
+{
+ int want = dev << 1 | listen;
+ uint8_t c[3];
+
+ if(queue_ren(g, op, 1)) return -1;
+ if(g->addr == want) return 0;
+ c[0] = '?';
+ c[1] = listen ? 0x40+dev : 0x20+dev;
+ c[2] = listen ? 0x20+g->my_addr : 0x40+g->my_addr;
+ g->addr = want;
+ return queue(g, op, 'C', c, 3);
+}
+
+/* drops the frames of op not written yet */
+static void
+drop_queued(struct gpibext *g, struct op *op)
+{
+ struct frm **pp = &g->out, *f;
+ g->out_last = NULL;
+ while((f = *pp)) {
+  if(f->op == op) {
+   *pp = f->next;
+   op->frames--;
+   free(f);
+   continue;
+  }
+  g->out_last = f;
+  pp = &f->next;
+ }
+}
+
+/* a request made of no frames is done at once */
+static int
+submitted(struct gpibext *g, struct op *op, int err)
+{
+ if(err) {
+  drop_queued(g, op);
+  op->r.st = GPIBEXT_IO;
+  op->done = 1;
+  return GPIBEXT_IO;
+ }
+ if(!op->frames) op->done = 1;
+ return op->id;
+}
+
+int
+gpibext_submit_send(struct gpibext *g, uint8_t dev, const void *p, unsigned len, int eoi)
+{
+ struct op *op = op_new(g);
+ uint8_t b[FRM_REQ_MAX];
+ unsigned l;
+ int err;
+
+ if(!op) return GPIBEXT_IO;
+ err = queue_addr(g, op, dev, 0);
+ do {
+  l = len > FRM_REQ_MAX-1 ? FRM_REQ_MAX-1 : len;
+  b[0] = eoi && l == len ? 4 : 0; /* GPIB_END_EOI */
+  memcpy(b+1, p, l);
+  if(!err) err = queue(g, op, 'D', b, l+1);
+  p = (const uint8_t *)p + l;
+  len -= l;
+ } while(len);
+ return submitted(g, op, err);
+}
+
+int
+gpibext_submit_recv(struct gpibext *g, uint8_t dev, unsigned max)
+{
+ struct op *op = op_new(g);
+ uint8_t l;
+ int err;
+
+ if(!op) return GPIBEXT_IO;
+ op->max = max;
+ op->r.recv = 1;
+ l = max && max < R_MAX ? max : R_MAX;
+ err = queue_addr(g, op, dev, 1);
+ if(!err) err = queue(g, op, 'R', &l, 1);
+ return submitted(g, op, err);
+}
+
+int
+gpibext_submit_ren(struct gpibext *g, int on)
+{
+ struct op *op = op_new(g);
+ if(!op) return GPIBEXT_IO;
+ return submitted(g, op, queue_ren(g, op, on != 0));
+}
+
+/* writes the queued frames the converter has room for in one burst */
+int
+gpibext_flush(struct gpibext *g)
+{
+ uint8_t buf[4096];
+ unsigned n = 0, size;
+ struct frm *f;
+
+ while((f = g->out) && !g->barrier) {
+  size = FRM_HDR_REQ+f->len+2;
+  if(g->window && g->inflight && g->inflight+size > g->window) break;
+  if(n+size > sizeof(buf)) break;
+  f->seq = g->seq_next++;
+  n += frame_put(buf+n, f->code, f->seq, -1, f->data, f->len);
+  g->inflight += size;
+  if(!(g->out = f->next)) g->out_last = NULL;
+  f->next = NULL;
+  if(g->sent_last) g->sent_last->next = f;
+  else g->sent = f;
+  g->sent_last = f;
+  /* the next R request, if any, must follow this one */
+  if(f->code == 'R' && (f->op->max == 0 || f->op->max > R_MAX)) g->barrier = f->op;
+ }
+ if(n && link_write(g->fd, buf, n)) {
+  set_err(g, link_error);
+  return -1;
+ }
+ return 0;
+}
+
+static void
+frame_done(struct gpibext *g, struct frm *f, const struct frame *fr)
+{
+ struct op *op = f->op;
+ struct frm *c;
+ unsigned left;
+ uint8_t l;
+ int st = fr ? fr->st : GPIBEXT_CRC;
+
+ g->inflight -= FRM_HDR_REQ+f->len+2;
+ if(st != GPIBEXT_OK) op_status(op, st);
+ switch(f->code) {
+         case 'C':
+                 if(st != GPIBEXT_OK) g->addr = ADDR_UNKNOWN;
+                 break;
+         case 'E':
+                 if(st != GPIBEXT_OK) g->ren = -1;
+                 break;
+         case 'D':
+                 if(fr && fr->len) op->r.len += fr->data[0];
+                 if(st != GPIBEXT_OK) drop_queued(g, op);
+                 break;
+         case 'R':
+                 if(!fr || !fr->len) break;
+                 op->r.end = fr->data[0];
+                 if(op_append(op, fr->data+1, fr->len-1)) op_status(op, GPIBEXT_ERROR);
+                 left = op->max ? op->max-op->r.len : R_MAX;
+                 if(st == GPIBEXT_OK && op->r.end == END_BUF && left && op->r.st == GPIBEXT_OK) {
+                  /* more to read: the next R goes before anything else */
+                  l = left < R_MAX ? left : R_MAX;
+                  if((c = frm_new(op, 'R', &l, 1))) {
+                   c->next = g->out;
+                   g->out = c;
+                   if(!g->out_last) g->out_last = c;
+                   g->barrier = NULL;
+                  }
+                 }
+                 break;
+         default:
+                 if(fr) op_append(op, fr->data, fr->len);
+ }
+ if(!--op->frames) {
+  op->done = 1;
+  if(g->barrier == op) g->barrier = NULL;
+ }
+ free(f);
+}
+
+static void
+response(struct gpibext *g, const struct frame *fr)
+{
+ struct frm *f;
+
+ for(f = g->sent; f && f->seq != fr->seq; f = f->next);
+ if(!f) return; /* stale */
+ /* the responses before it were corrupted */
+ while(g->sent != f) {
+  struct frm *x = g->sent;
+  g->sent = x->next;
+  frame_done(g, x, NULL);
+ }
+ if(!(g->sent = f->next)) g->sent_last = NULL;
+ frame_done(g, f, fr);
+}
+
+/* fails all the pending requests */
+static void
+link_lost(struct gpibext *g)
+{
+ struct op *op;
+ struct frm *f;
+
+ while((f = g->sent)) {
+  g->sent = f->next;
+  free(f);
+ }
+ while((f = g->out)) {
+  g->out = f->next;
+  free(f);
+ }
+ g->sent_last = g->out_last = NULL;
+ g->inflight = 0;
+ g->barrier = NULL;
+ g->addr = ADDR_UNKNOWN;
+ g->ren = -1;
+ for(op = g->ops; op; op = op->next) {
+  if(op->done) continue;
+  op->r.st = GPIBEXT_IO;
+  op->frames = 0;
+  op->done = 1;
+ }
+}
+
+static int
+wait_input(struct gpibext *g)
+{
+ struct pollfd pf = {g->fd, POLLIN, 0};
+ struct frame fr;
+ unsigned p = 0, l;
+ ssize_t n;
+
+ if(poll(&pf, 1, g->tmo) <= 0) {
+  set_err(g, "no response from the converter");
+  return -1;
+ }
+ if((n = read(g->fd, g->in+g->in_len, sizeof(g->in)-g->in_len)) <= 0) {
+  set_err(g, "connection closed");
+  return -1;
+ }
+ g->in_len += n;
+ while(p < g->in_len) {
+  if(g->in[p] != FRM_SYN) {
+   p++;
+   continue;
+  }
+  if(!(l = frame_get(g->in+p, g->in_len-p, 1, &fr))) break;
+  if(fr.bad) {
+   p++;
+   continue;
+  }
+  response(g, &fr);
+  p += l;
+ }
+ memmove(g->in, g->in+p, g->in_len-p);
+ g->in_len -= p;
+ return 0;
+}
+
+int
+gpibext_complete(struct gpibext *g, int id, struct gpibext_result *r)
+{
+ struct op *op, *prev = NULL;
+
+ if(g->ret) {
+  free(g->ret->data);
+  free(g->ret);
+  g->ret = NULL;
+ }
+ for(op = g->ops; op && op->id != id; op = op->next) prev = op;
+ if(!op) {
+  set_err(g, "no such request");
+  r->st = GPIBEXT_IO;
+  return GPIBEXT_IO;
+ }
+ while(!op->done) {
+  if(gpibext_flush(g) || wait_input(g)) link_lost(g);
+ }
+ if(prev) prev->next = op->next;
+ else g->ops = op->next;
+ if(g->ops_last == op) g->ops_last = prev;
+ g->ret = op;
+ *r = op->r;
+ r->data = op->data;
+ if(r->st != GPIBEXT_OK && r->st != GPIBEXT_IO) {
+  snprintf(g->err, sizeof(g->err), "%s", r->st == GPIBEXT_TIMEOUT ? "timeout"
+           : r->st == GPIBEXT_CRC ? "corrupted frame" : "request rejected");
+ }
+ return r->st;
+}
+
+int
+gpibext_option(struct gpibext *g, const char *name, int value)
+{
+ struct gpibext_result r;
+ struct op *op = op_new(g);
+ uint8_t b[FRM_REQ_MAX];
+ unsigned l = strlen(name);
+
+ if(!op) return GPIBEXT_IO;
+ if(l > FRM_REQ_MAX-3) l = FRM_REQ_MAX-3;
+ memcpy(b, name, l);
+ if(value >= 0) {
+  b[l] = 0;
+  b[l+1] = value;
+  b[l+2] = value >> 8;
+ }
+ if(submitted(g, op, queue(g, op, 'O', b, value >= 0 ? l+3 : l)) < 0
+    || gpibext_complete(g, op->id, &r) != GPIBEXT_OK || r.len != 2) return GPIBEXT_IO;
+ value = r.data[0] | r.data[1] << 8;
+ if(!strcmp(name, "C")) g->my_addr = value;
+ return value;
+}
+
+static void
+release(struct gpibext *g)
+{
+ struct op *op;
+
+ link_lost(g);
+ while((op = g->ops)) {
+  g->ops = op->next;
+  free(op->data);
+  free(op);
+ }
+ if(g->ret) {
+  free(g->ret->data);
+  free(g->ret);
+ }
+ link_close(g->fd);
+ free(g);
+}
+
+struct gpibext *
+gpibext_open(const char *path, unsigned baud)
+{
+ struct gpibext *g = calloc(1, sizeof(*g));
+
+ if(!g) return NULL;
+ if((g->fd = link_open(path, baud)) < 0) {
+  free(g);
+  return NULL;
+ }
+ g->window = link_is_socket(g->fd) ? 0 : WINDOW;
+ g->tmo = 10000;
+ g->addr = ADDR_UNKNOWN;
+ g->ren = -1;
+ g->id_next = 1;
+ /* the converter's own address, for the C requests */
+ if(gpibext_option(g, "C", -1) < 0) {
+  link_error = "converter's address unknown";
+  release(g);
+  return NULL;
+ }
+ return g;
+}
+
+void
+gpibext_close(struct gpibext *g)
+{
+ struct gpibext_result r;
+ struct op *op;
+
+ /* after the pending requests; through gpibd REN is left on, the
+    other clients' devices may be in remote */
+ if((op = op_new(g)) && !queue(g, op, 'C', "?_", 2)) {
+  if(!link_is_socket(g->fd)) queue_ren(g, op, 0);
+  gpibext_complete(g, op->id, &r);
+ }
+ release(g);
+}
+
+const char *
+gpibext_error(struct gpibext *g)
+{
+ return g ? g->err : link_error;
+}
+
+void
+gpibext_set_timeout(struct gpibext *g, unsigned ms)
+{
+ g->tmo = ms;
+}
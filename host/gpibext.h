@@ -0,0 +1,51 @@
+#pragma once
+/* Host library for the converter in the framed mode.
+
+   Requests are submitted without waiting, each gets an id, and they
+   complete in the order submitted. The frames of the pending requests are
+   written together when one is completed (or by gpibext_flush()), so a
+   write, the addressing for a read and the read go to the converter in one
+   burst. The bus addressing and REN are tracked here: a request for the
+   device and direction already addressed sends no C frame.
+
+   path is a serial port or the socket of gpibd (see gpibd.c). Not thread
+   safe, use one struct gpibext per thread. */
+#include <stdint.h>
+
+#define GPIBEXT_OK 0
+#define GPIBEXT_TIMEOUT 1 /* the converter's FRM_ST_*, see frame.h */
+#define GPIBEXT_ERROR 2
+#define GPIBEXT_CRC 3
+#define GPIBEXT_IO (-1)   /* the link is lost, see gpibext_error() */
+
+struct gpibext;
+
+struct gpibext_result {
+ int st;
+ unsigned len;        /* bytes sent or received */
+ uint8_t recv;        /* set for a recv request */
+ uint8_t end;         /* recv: GPIB_END_* flags of the last frame */
+ const uint8_t *data; /* recv: valid until the next gpibext_complete() */
+};
+
+/* baud is used for a serial port: 115200, 500000, 1000000 or 2000000 */
+struct gpibext *gpibext_open(const char *path, unsigned baud);
+/* unaddresses the bus, clears REN (not through gpibd) and leaves the
+   framed mode */
+void gpibext_close(struct gpibext *g);
+const char *gpibext_error(struct gpibext *g);
+/* the longest wait for a response, 10s by default */
+void gpibext_set_timeout(struct gpibext *g, unsigned ms);
+/* sets a converter option (see the O command) if value >= 0, after the
+   pending requests; returns its value or GPIBEXT_IO */
+int gpibext_option(struct gpibext *g, const char *name, int value);
+
+/* The submit functions return the request id or GPIBEXT_IO.
+   send ends the data with EOI if eoi is set. recv reads up to max bytes,
+   0 to read until the end of the message (as set by the R option). */
+int gpibext_submit_send(struct gpibext *g, uint8_t dev, const void *p, unsigned len, int eoi);
+int gpibext_submit_recv(struct gpibext *g, uint8_t dev, unsigned max);
+int gpibext_submit_ren(struct gpibext *g, int on);
+int gpibext_flush(struct gpibext *g);
+/* waits for request id, returns r->st */
+int gpibext_complete(struct gpibext *g, int id, struct gpibext_result *r);
@@ -0,0 +1,203 @@
+/* Tcl binding of gpibext.h
+     load host/gpibext.so
+     set g [gpibext::open path ?baud?]
+     $g send dev data ?-noeoi?          returns the number of bytes sent
+     $g recv dev ?max?                  returns the data
+     $g submit send dev data ?-noeoi?   returns a request id
+     $g submit recv dev ?max?
+     $g submit ren 0|1
+     $g complete id                     returns as send or recv
+     $g end                             end flags of the last recv
+     $g ren 0|1
+     $g option name ?value?             returns the option value
+     $g timeout ms
+     $g close
+   A failed request raises an error, errorCode is {GPIBEXT status}. */
+#include <stdio.h>
+#include <string.h>
+#include <tcl.h>
+
+#include "gpibext.h"
+
+struct handle {
+ struct gpibext *g;
+ Tcl_Command cmd;
+ uint8_t end;
+};
+
+static int
+gpib_error(Tcl_Interp *interp, struct handle *h, int st)
+{
+ char s[16];
+ sprintf(s, "%d", st);
+ Tcl_SetErrorCode(interp, "GPIBEXT", s, NULL);
+ Tcl_SetObjResult(interp, Tcl_NewStringObj(gpibext_error(h->g), -1));
+ return TCL_ERROR;
+}
+
+static int
+get_dev(Tcl_Interp *interp, Tcl_Obj *o, uint8_t *dev)
+{
+ int v;
+ if(Tcl_GetIntFromObj(interp, o, &v) != TCL_OK) return TCL_ERROR;
+ if(v < 0 || v > 30) {
+  Tcl_SetObjResult(interp, Tcl_NewStringObj("device address must be 0..30", -1));
+  return TCL_ERROR;
+ }
+ *dev = v;
+ return TCL_OK;
+}
+
+/* send|recv|ren arguments at objv[0], returns the request id or -1 */
+static int
+submit(Tcl_Interp *interp, struct handle *h, int objc, Tcl_Obj *const objv[])
+{
+ static const char *const ops[] = {"send", "recv", "ren", NULL};
+ int op, len, v = 0, id;
+ uint8_t dev;
+ const unsigned char *p;
+
+ if(objc < 2 || Tcl_GetIndexFromObj(interp, objv[0], ops, "request", 0, &op) != TCL_OK) {
+  if(objc < 2) Tcl_WrongNumArgs(interp, 0, objv, "send|recv|ren ...");
+  return -1;
+ }
+ if(op == 2) {
+  if(objc != 2 || Tcl_GetBooleanFromObj(interp, objv[1], &v) != TCL_OK) return -1;
+  id = gpibext_submit_ren(h->g, v);
+ } else {
+  if(get_dev(interp, objv[1], &dev) != TCL_OK) return -1;
+  if(op == 0) {
+   if(objc < 3 || objc > 4 || (objc == 4 && strcmp(Tcl_GetString(objv[3]), "-noeoi"))) {
+    Tcl_WrongNumArgs(interp, 1, objv, "dev data ?-noeoi?");
+    return -1;
+   }
+   p = Tcl_GetByteArrayFromObj(objv[2], &len);
+   id = gpibext_submit_send(h->g, dev, p, len, objc == 3);
+  } else {
+   if(objc > 3) {
+    Tcl_WrongNumArgs(interp, 1, objv, "dev ?max?");
+    return -1;
+   }
+   if(objc == 3 && Tcl_GetIntFromObj(interp, objv[2], &v) != TCL_OK) return -1;
+   id = gpibext_submit_recv(h->g, dev, v < 0 ? 0 : v);
+  }
+ }
+ if(id < 0) {
+  gpib_error(interp, h, id);
+  return -1;
+ }
+ return id;
+}
+
+static int
+complete(Tcl_Interp *interp, struct handle *h, int id)
+{
+ struct gpibext_result r;
+
+ if(gpibext_complete(h->g, id, &r) != GPIBEXT_OK) return gpib_error(interp, h, r.st);
+ if(r.recv) {
+  h->end = r.end;
+  Tcl_SetObjResult(interp, Tcl_NewByteArrayObj(r.data, r.len));
+ } else Tcl_SetObjResult(interp, Tcl_NewIntObj(r.len));
+ return TCL_OK;
+}
+
+static void
+handle_delete(ClientData cd)
+{
+ struct handle *h = cd;
+ gpibext_close(h->g);
+ ckfree((char *)h);
+}
+
+static int
+handle_cmd(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+ static const char *const cmds[] = {"send", "recv", "submit", "complete", "end",
+                                    "ren", "timeout", "close", "option", NULL};
+ struct handle *h = cd;
+ int c, id, v;
+
+ if(objc < 2) {
+  Tcl_WrongNumArgs(interp, 1, objv, "command ?arg ...?");
+  return TCL_ERROR;
+ }
+ if(Tcl_GetIndexFromObj(interp, objv[1], cmds, "command", 0, &c) != TCL_OK) return TCL_ERROR;
+ switch(c) {
+         case 0: /* send */
+         case 1: /* recv */
+         case 5: /* ren */
+                 if((id = submit(interp, h, objc-1, objv+1)) < 0) return TCL_ERROR;
+                 return complete(interp, h, id);
+         case 2: /* submit */
+                 if((id = submit(interp, h, objc-2, objv+2)) < 0) return TCL_ERROR;
+                 Tcl_SetObjResult(interp, Tcl_NewIntObj(id));
+                 return TCL_OK;
+         case 3: /* complete */
+                 if(objc != 3) {
+                  Tcl_WrongNumArgs(interp, 2, objv, "id");
+                  return TCL_ERROR;
+                 }
+                 if(Tcl_GetIntFromObj(interp, objv[2], &id) != TCL_OK) return TCL_ERROR;
+                 return complete(interp, h, id);
+         case 4: /* end */
+                 Tcl_SetObjResult(interp, Tcl_NewIntObj(h->end));
+                 return TCL_OK;
+         case 6: /* timeout */
+                 if(objc != 3 || Tcl_GetIntFromObj(interp, objv[2], &v) != TCL_OK) {
+                  if(objc != 3) Tcl_WrongNumArgs(interp, 2, objv, "ms");
+                  return TCL_ERROR;
+                 }
+                 gpibext_set_timeout(h->g, v);
+                 return TCL_OK;
+         case 7: /* close */
+                 Tcl_DeleteCommandFromToken(interp, h->cmd);
+                 return TCL_OK;
+         case 8: /* option */
+                 v = -1;
+                 if(objc < 3 || objc > 4) {
+                  Tcl_WrongNumArgs(interp, 2, objv, "name ?value?");
+                  return TCL_ERROR;
+                 }
+                 if(objc == 4 && Tcl_GetIntFromObj(interp, objv[3], &v) != TCL_OK) return TCL_ERROR;
+                 if((v = gpibext_option(h->g, Tcl_GetString(objv[2]), v)) < 0) return gpib_error(interp, h, v);
+                 Tcl_SetObjResult(interp, Tcl_NewIntObj(v));
+                 return TCL_OK;
+ }
+ return TCL_ERROR;
+}
+
+static int
+open_cmd(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+ static unsigned n;
+ struct handle *h;
+ int baud = 2000000;
+ char name[32];
+
+ if(objc < 2 || objc > 3) {
+  Tcl_WrongNumArgs(interp, 1, objv, "path ?baud?");
+  return TCL_ERROR;
+ }
+ if(objc == 3 && Tcl_GetIntFromObj(interp, objv[2], &baud) != TCL_OK) return TCL_ERROR;
+ h = (struct handle *)ckalloc(sizeof(*h));
+ memset(h, 0, sizeof(*h));
+ if(!(h->g = gpibext_open(Tcl_GetString(objv[1]), baud))) {
+  ckfree((char *)h);
+  Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s: %s", Tcl_GetString(objv[1]), gpibext_error(NULL)));
+  return TCL_ERROR;
+ }
+ sprintf(name, "gpibext%u", n++);
+ h->cmd = Tcl_CreateObjCommand(interp, name, handle_cmd, h, handle_delete);
+ Tcl_SetObjResult(interp, Tcl_NewStringObj(name, -1));
+ return TCL_OK;
+}
+
+int
+Gpibext_Init(Tcl_Interp *interp)
+{
+ if(!Tcl_InitStubs(interp, "8.5", 0)) return TCL_ERROR;
+ Tcl_CreateNamespace(interp, "gpibext", NULL, NULL);
+ Tcl_CreateObjCommand(interp, "gpibext::open", open_cmd, NULL, NULL);
+ return Tcl_PkgProvide(interp, "gpibext", "1.0");
+}
@@ -0,0 +1,10 @@
+#pragma once
+/* host build internals shared by avr.c, uart.c and vbus.c */
+#include <stdint.h>
+
+/* raises an interrupt, isr runs on the firmware thread once it's enabled */
+void host_irq(void (*isr)(void));
+/* around a HAL call, defers the ISRs to its end */
+void host_hal_begin(void);
+void host_hal_end(void);
+uint64_t host_time_ns(void);
@@ -0,0 +1,205 @@
+/* Connection to the converter, see link.h */
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "../uart.h"
+#include "frame.h"
+#include "link.h"
+
+const char *link_error = "";
+
+static const struct {
+ unsigned baud;
+ speed_t sp;
+ uint8_t opt;
+} speeds[] = {
+ {115200, B115200, UART_115200},
+ {500000, B500000, UART_500K},
+ {1000000, B1000000, UART_1M},
+ {2000000, B2000000, UART_2M},
+};
+
+int
+link_write(int fd, const void *p, size_t len)
+{
+ ssize_t n;
+ /* send: no SIGPIPE if gpibd is gone */
+ while(len) {
+  if((n = send(fd, p, len, MSG_NOSIGNAL)) < 0 && (n = write(fd, p, len)) <= 0) {
+   link_error = "write error";
+   return -1;
+  }
+  p = (const uint8_t *)p + n;
+  len -= n;
+ }
+ return 0;
+}
+
+static int
+ser_speed(int fd, speed_t sp)
+{
+ struct termios t;
+ if(tcgetattr(fd, &t)) {
+  link_error = "not a tty";
+  return -1;
+ }
+ cfmakeraw(&t);
+ t.c_cflag |= CLOCAL|CREAD;
+ t.c_cflag &= ~CRTSCTS;
+ cfsetispeed(&t, sp);
+ cfsetospeed(&t, sp);
+ if(tcsetattr(fd, TCSANOW, &t)) {
+  link_error = "baud rate not supported";
+  return -1;
+ }
+ tcflush(fd, TCIOFLUSH);
+ return 0;
+}
+
+/* reads until nothing arrives for tmo_ms */
+static unsigned
+ser_drain(int fd, char *buf, unsigned max, int tmo_ms)
+{
+ struct pollfd pf = {fd, POLLIN, 0};
+ unsigned n = 0;
+ ssize_t l;
+ char tmp[64];
+
+ while(poll(&pf, 1, tmo_ms) > 0) {
+  if(n < max) l = read(fd, buf+n, max-n);
+  else l = read(fd, tmp, sizeof(tmp));
+  if(l <= 0) break;
+  if(n < max) n += l;
+ }
+ return n;
+}
+
+/* sends a text mode command, 1 if it's answered with OK */
+static int
+ser_cmd(int fd, const char *c)
+{
+ char r[128];
+ unsigned n;
+
+ if(link_write(fd, c, strlen(c)) || link_write(fd, "\r", 1)) return 0;
+ n = ser_drain(fd, r, sizeof(r)-1, 100);
+ r[n] = 0;
+ return strstr(r, "OK\r\n") != NULL;
+}
+
+/* gets the converter from any mode and speed to the text mode at baud
+   with the echo off */
+static int
+ser_sync(int fd, unsigned s)
+{
+ uint8_t f[FRM_MAX];
+ char c[8];
+
+ if(ser_speed(fd, speeds[s].sp)) return -1;
+ /* leave the framed mode left by a previous run */
+ link_write(fd, f, frame_put(f, 'X', 0, -1, 0, 0));
+ sprintf(c, "OB%u", speeds[s].opt);
+ ser_cmd(fd, "");
+ /* set the speed anyway, a pty answers at any speed */
+ if(ser_cmd(fd, "O1")) return ser_cmd(fd, c) ? 0 : -1;
+ link_error = "no response from the converter";
+ if(s == 0 || ser_speed(fd, B115200)) return -1;
+ ser_cmd(fd, "");
+ if(!ser_cmd(fd, "O1")) return -1;
+ ser_cmd(fd, c);
+ usleep(10000);
+ if(ser_speed(fd, speeds[s].sp)) return -1;
+ ser_cmd(fd, "");
+ if(ser_cmd(fd, "O1")) return 0;
+ link_error = "no response after the baud rate change";
+ return -1;
+}
+
+static int
+ser_init(int fd, unsigned s)
+{
+ uint8_t f[FRM_MAX];
+ unsigned n, p, i;
+ struct frame fr;
+
+ /* opening the port may reset the board, the bootloader runs for ~1s */
+ for(i = 0; ser_sync(fd, s); i++) {
+  if(i == 2) return -1;
+  usleep(500000);
+ }
+ link_write(fd, "F\r", 2);
+ n = ser_drain(fd, (char *)f, sizeof(f), 200);
+ for(p = 0; p < n; p++) {
+  if(f[p] == FRM_SYN && frame_get(f+p, n-p, 1, &fr) && !fr.bad
+     && fr.op == 'F' && fr.st == FRM_ST_OK) return 0;
+ }
+ link_error = "framed mode not entered";
+ return -1;
+}
+
+int
+link_open(const char *path, unsigned baud)
+{
+ struct sockaddr_un a;
+ struct stat st;
+ unsigned s;
+ int fd;
+
+ if(stat(path, &st)) {
+  link_error = "no such file";
+  return -1;
+ }
+ if(S_ISSOCK(st.st_mode)) {
+  if(strlen(path) >= sizeof(a.sun_path) || (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+   link_error = "socket";
+   return -1;
+  }
+  memset(&a, 0, sizeof(a));
+  a.sun_family = AF_UNIX;
+  strcpy(a.sun_path, path);
+  if(connect(fd, (struct sockaddr *)&a, sizeof(a))) {
+   close(fd);
+   link_error = "connection refused";
+   return -1;
+  }
+  return fd;
+ }
+ for(s = 0; s < sizeof(speeds)/sizeof(speeds[0]) && speeds[s].baud != baud; s++);
+ if(s == sizeof(speeds)/sizeof(speeds[0])) {
+  link_error = "baud rate must be 115200, 500000, 1000000 or 2000000";
+  return -1;
+ }
+ if((fd = open(path, O_RDWR|O_NOCTTY)) < 0) {
+  link_error = "can't open the port";
+  return -1;
+ }
+ if(ser_init(fd, s)) {
+  close(fd);
+  return -1;
+ }
+ return fd;
+}
+
+int
+link_is_socket(int fd)
+{
+ struct stat st;
+ return !fstat(fd, &st) && S_ISSOCK(st.st_mode);
+}
+
+void
+link_close(int fd)
+{
+ uint8_t f[FRM_MAX];
+ if(!link_is_socket(fd)) link_write(fd, f, frame_put(f, 'X', 0, -1, 0, 0));
+ close(fd);
+}
@@ -0,0 +1,15 @@
+#pragma once
+/* Connection to the converter in the framed mode, for the host programs */
+#include <stddef.h>
+
+/* Opens a serial port and puts the converter into the framed mode at baud
+   (115200, 500000, 1000000 or 2000000), or connects to the socket of
+   gpibd. Returns the file descriptor, or -1 with link_error set. */
+int link_open(const char *path, unsigned baud);
+/* 1 for a gpibd connection: the daemon paces the requests itself */
+int link_is_socket(int fd);
+/* leaves the framed mode on a serial port and closes fd */
+void link_close(int fd);
+int link_write(int fd, const void *p, size_t len);
+
+extern const char *link_error;
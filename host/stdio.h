@@ -0,0 +1,10 @@
+/* host build: avr-libc stdio extensions on top of the C library */
+#include_next <stdio.h>
+
+#ifndef HOST_STDIO_H
+#define HOST_STDIO_H
+
+FILE *fdevopen(int (*put)(char, FILE *), int (*get)(FILE *));
+int printf_P(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+#endif
@@ -0,0 +1,279 @@
+/* Virtual UART for the host build.
+   Uses stdin/stdout, a pseudo terminal if UART_PTY is set (its value, if
+   not "1", is the name of a symlink to create for the slave side), or the
+   file descriptor in UART_FD. Bytes are
+   paced at the selected baud rate through rings of the same size as the AVR
+   ones, so an overrun drops data like the RX ISR does. UART_PACE=0 disables
+   the pacing. When the input ends, the program exits once the output has
+   been idle for 1s. */
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "../uart.h"
+#include "host.h"
+
+static int rx_fd = 0, tx_fd = 1;
+static uint8_t pace = 1;
+static uint64_t byte_ns;
+static volatile uint8_t rx_eof;
+static volatile uint64_t tx_last;
+
+static uint8_t rx_ring[UART_RX_FIFO_SIZE];
+static uint8_t rx_rp, rx_wp;
+static uint8_t esc;
+static uint8_t rx_buf[4096]; /* read from rx_fd, not received yet */
+static unsigned rx_buf_pos, rx_buf_len;
+static uint64_t rx_next; /* time the next byte from rx_buf is received */
+static uint64_t rx_read; /* time of the last read from rx_fd */
+static uint64_t tx_done; /* time the tx ring becomes empty */
+static uint16_t err_cnt[UART_ERR_NUM]; /* frame errors and overruns can't happen here */
+
+static struct termios tio_saved;
+
+static void
+tty_restore(void)
+{
+ tcsetattr(0, TCSANOW, &tio_saved);
+}
+
+static void
+tty_signal(int sig)
+{
+ tty_restore();
+ signal(sig, SIG_DFL);
+ raise(sig);
+}
+
+static void
+tty_raw(int fd)
+{
+ struct termios t;
+ tcgetattr(fd, &t);
+ t.c_iflag &= ~(ICRNL|INLCR|IGNCR|IXON);
+ t.c_lflag &= ~(ICANON|ECHO);
+ t.c_cc[VMIN] = 1;
+ t.c_cc[VTIME] = 0;
+ tcsetattr(fd, TCSANOW, &t);
+}
+
+static void
+pty_open(const char *link)
+{
+ int s;
+ const char *name;
+ struct termios t;
+
+ rx_fd = posix_openpt(O_RDWR|O_NOCTTY);
+ if(rx_fd < 0 || grantpt(rx_fd) || unlockpt(rx_fd) || !(name = ptsname(rx_fd))) {
+  perror("pty");
+  exit(1);
+ }
+ tx_fd = rx_fd;
+ /* keep the slave open, so the master doesn't get EIO between clients */
+ s = open(name, O_RDWR|O_NOCTTY);
+ if(s >= 0 && tcgetattr(s, &t) == 0) {
+  cfmakeraw(&t);
+  tcsetattr(s, TCSANOW, &t);
+ }
+ if(link[0] != '1' || link[1]) {
+  unlink(link);
+  if(symlink(name, link)) perror(link);
+ }
+ fprintf(stderr, "uart: %s\n", name);
+}
+
+static void *
+linger_thread(void *arg)
+{
+ for(;;) {
+  usleep(10000);
+  if(rx_eof && host_time_ns() - tx_last > 1000000000ULL) exit(0);
+ }
+ return NULL;
+}
+
+void
+uart_init(uint8_t spd)
+{
+ const char *e;
+ pthread_t t;
+
+ uart_set_speed(spd);
+ e = getenv("UART_PACE");
+ if(e && e[0] == '0') pace = 0;
+ e = getenv("UART_PTY");
+ if(e) pty_open(e);
+ else if((e = getenv("UART_FD"))) rx_fd = tx_fd = atoi(e);
+ else if(isatty(0)) {
+  tcgetattr(0, &tio_saved);
+  atexit(tty_restore);
+  signal(SIGINT, tty_signal);
+  signal(SIGTERM, tty_signal);
+  tty_raw(0);
+ }
+ fcntl(rx_fd, F_SETFL, fcntl(rx_fd, F_GETFL) | O_NONBLOCK);
+ tx_last = host_time_ns();
+ pthread_create(&t, NULL, linger_thread, NULL);
+}
+
+void
+uart_set_speed(uint8_t spd)
+{
+ uint32_t baud;
+ switch(spd) {
+  default: baud = 115200; break;
+  case UART_500K: baud = 500000; break;
+  case UART_1M: baud = 1000000; break;
+  case UART_2M: baud = 2000000; break;
+ }
+ byte_ns = 10*1000000000ULL/baud;
+}
+
+void
+uart_set_ubrr(uint16_t ubrr)
+{
+ byte_ns = 10*1000000000ULL/(2000000/(ubrr+1));
+}
+
+/* there is no line to measure, the saved divider is used */
+uint16_t
+uart_autobaud(uint16_t tmo_ms)
+{
+ return UART_UBRR_NONE;
+}
+
+/* moves the bytes received by now into the ring */
+static void
+rx_poll(void)
+{
+ uint64_t now = host_time_ns();
+ uint8_t next, b;
+ ssize_t n;
+
+ /* nothing can arrive faster than a byte time */
+ if(rx_buf_pos == rx_buf_len && !rx_eof && (!pace || now-rx_read >= byte_ns)) {
+  rx_read = now;
+  n = read(rx_fd, rx_buf, sizeof(rx_buf));
+  if(n == 0) rx_eof = 1;
+  if(n <= 0) return;
+  rx_buf_pos = 0;
+  rx_buf_len = n;
+  if(rx_next < now) rx_next = now;
+ }
+ while(rx_buf_pos != rx_buf_len && (!pace || rx_next <= now)) {
+  next = (rx_wp+1) & (UART_RX_FIFO_SIZE-1);
+#ifdef UART_FLOW_CTRL
+  if(next == rx_rp) break; /* RTS is raised, the host holds the data */
+#endif
+  b = rx_buf[rx_buf_pos++];
+  rx_next += byte_ns;
+  if(b == 27) esc = 1;
+  if(next == rx_rp) { /* overrun */
+   if(err_cnt[UART_ERR_RING] != 0xffff) err_cnt[UART_ERR_RING]++;
+   continue;
+  }
+  rx_ring[rx_wp] = b;
+  rx_wp = next;
+ }
+}
+
+uint8_t
+uart_rx_esc_char(void)
+{
+ rx_poll();
+ if(esc) {
+  esc = 0;
+  return 1;
+ }
+ return 0;
+}
+
+void
+uart_tx(uint8_t b)
+{
+ uint64_t now = host_time_ns();
+
+ if(pace) {
+  if(tx_done < now) tx_done = now;
+  /* the ring is full, now may pass tx_done while waiting */
+  if(tx_done > now + (UART_TX_FIFO_SIZE-1)*byte_ns && err_cnt[UART_ERR_TX_STALL] != 0xffff)
+   err_cnt[UART_ERR_TX_STALL]++;
+  while(tx_done > now + (UART_TX_FIFO_SIZE-1)*byte_ns) {
+   sched_yield();
+   now = host_time_ns();
+  }
+  tx_done += byte_ns;
+ }
+ while(write(tx_fd, &b, 1) < 0) {
+  struct pollfd p = {tx_fd, POLLOUT, 0};
+  poll(&p, 1, -1);
+ }
+ tx_last = now;
+}
+
+void
+uart_write(const uint8_t *s, uint8_t len)
+{
+ while(len--) uart_tx(*s++);
+}
+
+void
+uart_err_get(uint16_t *cnt, uint8_t clear)
+{
+ uint8_t i;
+ for(i = 0; i < UART_ERR_NUM; i++) {
+  cnt[i] = err_cnt[i];
+  if(clear) err_cnt[i] = 0;
+ }
+}
+
+uint8_t
+uart_rx_count(void)
+{
+ rx_poll();
+ return (rx_wp-rx_rp) & (UART_RX_FIFO_SIZE-1);
+}
+
+uint8_t
+uart_rx_empty(void)
+{
+ rx_poll();
+ return rx_wp == rx_rp;
+}
+
+uint8_t
+uart_tx_empty(void)
+{
+ return !pace || host_time_ns() >= tx_done;
+}
+
+uint8_t
+uart_rx(void)
+{
+ uint8_t b;
+ struct pollfd p = {rx_fd, POLLIN, 0};
+
+ while(uart_rx_empty()) {
+  if(rx_eof) usleep(1000);
+  else if(rx_buf_pos == rx_buf_len) poll(&p, 1, 10);
+ }
+ b = rx_ring[rx_rp];
+ rx_rp = (rx_rp+1) & (UART_RX_FIFO_SIZE-1);
+ return b;
+}
+
+uint8_t
+uart_peek(void)
+{
+ return rx_ring[rx_rp];
+}
@@ -0,0 +1,12 @@
+#pragma once
+#include <stdint.h>
+
+/* CRC-16/XMODEM, polynomial 0x1021, as in avr-libc */
+static inline uint16_t
+_crc_xmodem_update(uint16_t crc, uint8_t data)
+{
+ uint8_t i;
+ crc ^= (uint16_t)data << 8;
+ for(i = 0; i < 8; i++) crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+ return crc;
+}
@@ -0,0 +1,6 @@
+#pragma once
+#include <stdint.h>
+
+void host_delay_ns(uint64_t ns);
+#define _delay_us(us) host_delay_ns((uint64_t)((us)*1000))
+#define _delay_ms(ms) host_delay_ns((uint64_t)((ms)*1000000))
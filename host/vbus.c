@@ -0,0 +1,419 @@
+/* Virtual GPIB bus.
+   The lines are wired-OR: a line is asserted if the converter or the device
+   asserts it. The device is stepped on every HAL call, so it reacts to the
+   converter without delay. DAV and SRQ pin change interrupts are taken on
+   return from the HAL call that caused them, like an interrupt taken after
+   the instruction, and a thread checks for the changes made by the device
+   on its own. */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <avr/io.h>
+
+#include "../gpib_hal.h"
+#include "host.h"
+#include "vbus.h"
+
+void GPIB_DAV_vect(void);
+void GPIB_SRQ_vect(void);
+
+static pthread_mutex_t bus_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t c_data, c_ctl; /* asserted by the converter */
+static uint8_t p_data, p_ctl; /* asserted by the device */
+static uint8_t seen; /* lines at the last check for pin changes */
+static volatile uint8_t dav_irq, srq_irq;
+static uint8_t dav_pend, srq_pend;
+static uint64_t t_rfd, t_dav, t_put;
+
+static void dav_isr(void);
+static void srq_isr(void);
+
+#define SH_IDLE 0
+#define SH_RFD  1 /* data is on the bus, waiting for NRFD release */
+#define SH_DAC  2 /* DAV is asserted, waiting for NDAC release */
+
+static struct {
+ uint8_t addr;
+ uint8_t sad; /* secondary address, 0xff if none */
+ uint8_t lpas, tpas; /* primary address received, secondary expected */
+ uint8_t lad, tad, spe;
+ uint8_t ah; /* byte accepted, waiting for DAV release */
+ uint8_t sh;
+ uint8_t status;
+ uint8_t sp_done;
+ uint8_t ppc; /* PPC received, PPE/PPD expected */
+ uint8_t pp; /* 0x80 | sense<<3 | line-1 if configured */
+ uint8_t ppr; /* parallel poll response is on the bus */
+ uint8_t fixed, repeat;
+ uint16_t msg_len;
+ uint16_t talk_len, talk_pos;
+ uint8_t msg[256];
+ uint8_t talk[16384];
+ struct vbus_stats st;
+} dev = {.addr = 23, .sad = 0xff};
+
+static inline uint8_t lines(void) {return c_ctl|p_ctl;}
+
+static void
+dev_message(void)
+{
+ static const char idn[] = "HP3478EXT,VBUS,0,0\n";
+
+ if(dev.fixed) {
+  dev.msg_len = 0;
+  return;
+ }
+ if(dev.msg_len >= 5 && memcmp(dev.msg, "*IDN?", 5) == 0) {
+  memcpy(dev.talk, idn, sizeof(idn)-1);
+  dev.talk_len = sizeof(idn)-1;
+ } else {
+  memcpy(dev.talk, dev.msg, dev.msg_len);
+  dev.talk_len = dev.msg_len;
+ }
+ dev.talk_pos = 0;
+ dev.msg_len = 0;
+}
+
+static void
+dev_command(uint8_t c)
+{
+ c &= 0x7f;
+ if(dev.ppc && c >= 0x60) {
+  dev.pp = c < 0x70 ? 0x80 | (c & 0xf) : 0; /* PPE, PPD */
+  return;
+ }
+ dev.ppc = 0;
+ /* extended addressing: MLA/MTA followed by MSA */
+ if(dev.sad != 0xff) {
+  if(c >= 0x60) {
+   if(dev.lpas) {
+    dev.lad = (c & 0x1f) == dev.sad;
+    if(dev.lad) dev.tad = 0;
+   }
+   if(dev.tpas) {
+    dev.tad = (c & 0x1f) == dev.sad;
+    if(dev.tad) {
+     dev.lad = 0;
+     dev.talk_pos = 0;
+     dev.sp_done = 0;
+    }
+   }
+   dev.lpas = dev.tpas = 0;
+   return;
+  }
+  dev.lpas = c == 0x20+dev.addr;
+  dev.tpas = c == 0x40+dev.addr;
+  if(dev.lpas || dev.tpas) return;
+ }
+ if(c == 0x3f) dev.lad = 0; /* UNL */
+ else if(c == 0x5f) dev.tad = 0; /* UNT */
+ /* L4/T6 subsets: MTA unaddresses the listener and MLA the talker */
+ else if(c == 0x20+dev.addr) {
+  dev.lad = 1;
+  dev.tad = 0;
+ }
+ else if(c == 0x40+dev.addr) {
+  dev.lad = 0;
+  dev.tad = 1;
+  dev.talk_pos = 0;
+  dev.sp_done = 0;
+ }
+ else if(c >= 0x40 && c < 0x5f) dev.tad = 0; /* other talker */
+ else if(c == 0x18) dev.spe = 1;
+ else if(c == 0x19) dev.spe = 0;
+ else if(c == 0x14 || (c == 0x04 && dev.lad)) dev.msg_len = 0; /* DCL, SDC */
+ else if(c == 0x05 && dev.lad) dev.ppc = 1;
+ else if(c == 0x15) dev.pp = 0; /* PPU */
+}
+
+static void
+dev_step(void)
+{
+ uint8_t l = lines();
+ uint8_t atn = l & VBUS_ATN;
+ uint8_t d;
+
+ if(l & VBUS_IFC) {
+  dev.lad = dev.tad = dev.spe = 0;
+  dev.lpas = dev.tpas = 0;
+  dev.ah = 0;
+  dev.sh = SH_IDLE;
+  p_ctl &= VBUS_SRQ;
+  p_data = 0;
+  return;
+ }
+
+ /* parallel poll, ist is the SRQ state */
+ if(atn && (l & VBUS_EOI)) {
+  p_data = 0;
+  if((dev.pp & 0x80) && !!(p_ctl & VBUS_SRQ) == ((dev.pp >> 3) & 1))
+   p_data = 1 << (dev.pp & 7);
+  dev.ppr = 1;
+  return;
+ }
+ if(dev.ppr) {
+  p_data = 0;
+  dev.ppr = 0;
+ }
+
+ /* acceptor, all devices accept commands */
+ if(atn || dev.lad) {
+  if(!dev.ah) {
+   p_ctl = (p_ctl & ~VBUS_NRFD) | VBUS_NDAC;
+   if(l & VBUS_DAV) {
+    d = c_data|p_data;
+    p_ctl = (p_ctl | VBUS_NRFD) & ~VBUS_NDAC;
+    dev.ah = 1;
+    if(atn) {
+     dev.st.cmd_bytes++;
+     dev_command(d);
+    } else {
+     dev.st.rx_bytes++;
+     if(dev.msg_len < sizeof(dev.msg)) dev.msg[dev.msg_len++] = d;
+     if((l & VBUS_EOI) || d == '\n') dev_message();
+    }
+   }
+  } else if(!(l & VBUS_DAV)) {
+   dev.ah = 0;
+   p_ctl = (p_ctl & ~VBUS_NRFD) | VBUS_NDAC;
+  }
+ } else {
+  dev.ah = 0;
+  p_ctl &= ~(VBUS_NRFD|VBUS_NDAC);
+ }
+
+ /* source */
+ if(!dev.tad || atn) {
+  if(dev.sh != SH_IDLE) {
+   p_ctl &= ~(VBUS_DAV|VBUS_EOI);
+   p_data = 0;
+   dev.sh = SH_IDLE;
+  }
+  return;
+ }
+ switch(dev.sh) {
+  case SH_IDLE:
+   if(dev.spe) {
+    if(dev.sp_done) break;
+    p_data = dev.status;
+   } else {
+    if(dev.talk_pos >= dev.talk_len) break;
+    p_data = dev.talk[dev.talk_pos];
+    if(!dev.repeat && dev.talk_pos == dev.talk_len-1) p_ctl |= VBUS_EOI;
+   }
+   dev.sh = SH_RFD;
+   break;
+  case SH_RFD:
+   /* NDAC released too means there are no listeners */
+   if((l & VBUS_NRFD) || !(l & VBUS_NDAC)) break;
+   p_ctl |= VBUS_DAV;
+   dev.sh = SH_DAC;
+   break;
+  case SH_DAC:
+   if(l & VBUS_NDAC) break;
+   p_ctl &= ~(VBUS_DAV|VBUS_EOI);
+   p_data = 0;
+   dev.sh = SH_IDLE;
+   if(dev.spe) {
+    dev.sp_done = 1;
+    dev.status &= ~0x40;
+    p_ctl &= ~VBUS_SRQ;
+   } else {
+    dev.st.tx_bytes++;
+    if(++dev.talk_pos == dev.talk_len && dev.fixed) dev.talk_pos = 0;
+   }
+   break;
+ }
+}
+
+static void
+hs_add(uint64_t ns)
+{
+ dev.st.hs_count++;
+ dev.st.hs_ns += ns;
+ if(ns > dev.st.hs_max_ns) dev.st.hs_max_ns = ns;
+}
+
+static void
+hs_time(uint8_t l)
+{
+ uint64_t now = host_time_ns();
+ uint8_t rise = l & ~seen, fall = seen & ~l;
+
+ if(fall & VBUS_NRFD) t_rfd = now;
+ if(rise & VBUS_DAV) {
+  t_dav = now;
+  if(c_ctl & VBUS_DAV) hs_add(now-(t_put > t_rfd ? t_put : t_rfd));
+ }
+ if((fall & VBUS_NDAC) && (p_ctl & VBUS_DAV)) hs_add(now-t_dav);
+}
+
+/* steps the device until it settles, then checks for pin changes */
+static void
+bus_sync(void)
+{
+ uint8_t i, l, pd, pc, ah, sh;
+
+ for(i = 0; i < 8; i++) {
+  pd = p_data; pc = p_ctl; ah = dev.ah; sh = dev.sh;
+  dev_step();
+  if(pd == p_data && pc == p_ctl && ah == dev.ah && sh == dev.sh) break;
+ }
+ l = lines();
+ if(l != seen) hs_time(l);
+ if(((l ^ seen) & VBUS_DAV) && dav_irq) {
+  dav_pend = 1;
+  host_irq(dav_isr);
+ }
+ if(((l ^ seen) & VBUS_SRQ) && srq_irq) {
+  srq_pend = 1;
+  host_irq(srq_isr);
+ }
+ seen = l;
+}
+
+/* the pin change flags are checked when the ISR runs, dav_irq_enable()
+   clears a pending DAV change like the firmware's PCIFR write */
+static void
+dav_isr(void)
+{
+ uint8_t d;
+
+ pthread_mutex_lock(&bus_lock);
+ d = dav_pend;
+ dav_pend = 0;
+ pthread_mutex_unlock(&bus_lock);
+ if(d && dav_irq) GPIB_DAV_vect();
+}
+
+static void
+srq_isr(void)
+{
+ uint8_t s;
+
+ pthread_mutex_lock(&bus_lock);
+ s = srq_pend;
+ srq_pend = 0;
+ pthread_mutex_unlock(&bus_lock);
+ if(s) GPIB_SRQ_vect();
+}
+
+static void *
+vbus_thread(void *arg)
+{
+ struct timespec t = {0, 100000};
+
+ for(;;) {
+  nanosleep(&t, NULL);
+  pthread_mutex_lock(&bus_lock);
+  bus_sync();
+  pthread_mutex_unlock(&bus_lock);
+ }
+ return NULL;
+}
+
+#define BUS(stmt) do { \
+  host_hal_begin(); \
+  pthread_mutex_lock(&bus_lock); \
+  stmt; \
+  bus_sync(); \
+  pthread_mutex_unlock(&bus_lock); \
+  host_hal_end(); \
+ } while(0)
+
+static void
+drive(uint8_t m, uint8_t x)
+{
+ BUS(if(x) c_ctl |= m; else c_ctl &= ~m);
+}
+
+static uint8_t
+sense(uint8_t m)
+{
+ uint8_t l;
+ BUS(l = lines());
+ return (l & m) != 0;
+}
+
+/* HAL */
+void cfg_data_in(void) {BUS(c_data = 0);}
+void cfg_data_out(void) {}
+void data_put(uint8_t d) {BUS(c_data = d; t_put = host_time_ns());}
+
+uint8_t
+data_get(void)
+{
+ uint8_t d;
+ BUS(d = c_data|p_data);
+ return d;
+}
+
+void eoi_set(uint8_t x) {drive(VBUS_EOI, x);}
+void dav_set(uint8_t x) {drive(VBUS_DAV, x);}
+void nrfd_set(uint8_t x) {drive(VBUS_NRFD, x);}
+void ndac_set(uint8_t x) {drive(VBUS_NDAC, x);}
+void SetIFC(uint8_t x) {drive(VBUS_IFC, !x);}
+void set_atn(uint8_t x) {drive(VBUS_ATN, x);}
+void set_ren(uint8_t x) {drive(VBUS_REN, x);}
+
+uint8_t dav(void) {return sense(VBUS_DAV);}
+uint8_t ndac(void) {return sense(VBUS_NDAC);}
+uint8_t nrfd(void) {return sense(VBUS_NRFD);}
+uint8_t srq(void) {return sense(VBUS_SRQ);}
+uint8_t eoi(void) {return sense(VBUS_EOI);}
+uint8_t ren(void) {return (c_ctl & VBUS_REN) != 0;}
+uint8_t atn(void) {return (c_ctl & VBUS_ATN) != 0;}
+
+void dav_pullup(uint8_t x) {}
+void dav_irq_disable(void) {dav_irq = 0;}
+void dav_irq_enable(void) {BUS(dav_pend = 0; dav_irq = 1);}
+
+void
+gpib_hal_init(void)
+{
+ pthread_t t;
+ const char *a = getenv("VBUS_ADDR");
+
+ if(a) dev.addr = atoi(a);
+ a = getenv("VBUS_SAD");
+ if(a) dev.sad = atoi(a);
+ srq_irq = 1;
+ pthread_create(&t, NULL, vbus_thread, NULL);
+}
+
+/* device control */
+void
+vbus_dev_addr(uint8_t addr)
+{
+ BUS(dev.addr = addr);
+}
+
+void
+vbus_dev_talk(const void *data, uint16_t len, uint8_t repeat)
+{
+ if(len > sizeof(dev.talk)) len = sizeof(dev.talk);
+ BUS(
+  memcpy(dev.talk, data, len);
+  dev.talk_len = len;
+  dev.talk_pos = 0;
+  dev.fixed = len != 0;
+  dev.repeat = repeat && len != 0
+ );
+}
+
+void
+vbus_dev_srq(uint8_t status)
+{
+ BUS(dev.status = status|0x40; p_ctl |= VBUS_SRQ);
+}
+
+void
+vbus_get_stats(struct vbus_stats *s, uint8_t clear)
+{
+ BUS(
+  *s = dev.st;
+  if(clear) memset(&dev.st, 0, sizeof(dev.st))
+ );
+}
@@ -0,0 +1,37 @@
+#pragma once
+/* Virtual GPIB bus with one simulated device.
+   The device accepts commands and data like an instrument at the primary
+   address VBUS_ADDR (23 by default), with the secondary address VBUS_SAD
+   if set: a message ending with EOI or <LF> is echoed back when the device
+   is addressed to talk, "*IDN?" returns an identification string. Serial
+   poll returns the status byte. */
+#include <stdint.h>
+
+#define VBUS_EOI  0x01
+#define VBUS_DAV  0x02
+#define VBUS_NRFD 0x04
+#define VBUS_NDAC 0x08
+#define VBUS_IFC  0x10
+#define VBUS_SRQ  0x20
+#define VBUS_ATN  0x40
+#define VBUS_REN  0x80
+
+struct vbus_stats {
+ uint32_t cmd_bytes; /* accepted by the device with ATN */
+ uint32_t rx_bytes;  /* data accepted by the device */
+ uint32_t tx_bytes;  /* data sent by the device */
+ /* converter handshake latency: data and NRFD release to DAV when it's
+    the talker, DAV to NDAC release when it's the listener */
+ uint32_t hs_count;
+ uint64_t hs_ns;
+ uint64_t hs_max_ns;
+};
+
+void vbus_dev_addr(uint8_t addr);
+/* replaces the echo with fixed data, sent with EOI on the last byte every
+   time the device is read. If repeat is set, the data is sent endlessly
+   without EOI. len = 0 restores the echo. */
+void vbus_dev_talk(const void *data, uint16_t len, uint8_t repeat);
+/* asserts SRQ, status is returned by the serial poll with bit 6 set */
+void vbus_dev_srq(uint8_t status);
+void vbus_get_stats(struct vbus_stats *s, uint8_t clear);
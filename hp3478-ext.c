@@ -16,12 +16,16 @@
 #include <avr/io.h>
 #include <avr/eeprom.h>
 #include <ctype.h>
+#include <math.h>
 #include <avr/pgmspace.h>
 #include <avr/interrupt.h>
+#include <avr/wdt.h>
 #define F_CPU 16000000UL  
 #include <util/delay.h>
+#include <util/crc16.h>
 
 #include "uart.h"
+#include "gpib_hal.h"
 #include "eepmap.h"
 #include "version.h"
 
@@ -30,8 +34,6 @@
  TODO list
 
  - Display 0 with O?
- - Implement unbuffered binary write TUD using escape-sequence as stop
- - Implement unbuffered binary read TUD using escape-sequence as stop
  - Save & restore "ext" functions using presets.
  - Add dBm measurements in ACV.
  */
@@ -57,6 +59,7 @@
 
 #define GPIB_TALK_ADDR_OFFSET 64
 #define GPIB_LISTEN_ADDR_OFFSET 32
+#define GPIB_SECONDARY_ADDR_OFFSET 96
 
 /* GPIB status byte / SRQ mask / status byte 3 */
 #define HP3478_SB_DREADY (1<<0)
@@ -100,12 +103,6 @@
 #define HP3478_ST_CAL_ENABLED  (1<<5)
 #define HP3478_ST_EXT_TRIGGER  (1<<6)
 
-#define SET_PORT_PIN(PORT, PIN, V) if(V) PORT |= PIN; else PORT &= ~PIN
-#define CAT(a, b) a ## b
-#define PORT(X) CAT(PORT, X)
-#define DDR(X) CAT(DDR, X)
-#define PIN(X) CAT(PIN, X)
-
 #if 0
 #define DIAG_STR(s) #s
 #define DIAG_JOINSTR(x,y) DIAG_STR(x ## y)
@@ -117,107 +114,20 @@
 #endif
 
 /* configuration constants & defaults */
-#define GPIB_BUF_SIZE 127
-#define GPIB_MAX_RECEIVE_TIMEOUT_mS 200
-#define GPIB_MAX_TRANSMIT_TIMEOUT_mS 200
-
-/* PIN assignment */
-/*
- GPIB|       |                    |            | atmega  |
- pin | name  | description        | direction  | pin     |    
- ----+-------+--------------------+------------+---------+
- 1   | DIO1  | Data bit 1 (LSB)   | Talker     | PD2  32 | 2
- 2   | DIO2  | Data bit 2         | Talker     | PD3   1 | 3
- 3   | DIO3  | Data bit 3         | Talker     | PD4   2 | 4
- 4   | DIO4  | Data bit 4         | Talker     | PD5   9 | 5
- 5   | EOI   | End Of Identity    | Talker     | PB3  15 | 11
- 6   | DAV   | Data Valid         | Talker     | PB4  16 | 12
- 7   | NRFD  | Not Ready For Data | Listener   | PC0  23 | A0
- 8   | NDAC  | No Data Accepted   | Listener   | PC1  24 | A1
- 9   | IFC   | Interface Clear    | Controller | PC2  25 | A2
- 10  | SRQ   | Service Request    | Slave      | PC3  26 | A3
- 11  | ATN   | Attention          | Controller | PC4  27 | A4
- 12  |       | Shield             |            |         |
- 13  | DIO5  | Data bit 5         | Talker     | PD6  10 | 6
- 14  | DIO6  | Data bit 6         | Talker     | PD7  11 | 7
- 15  | DIO7  | Data Bit 7         | Talker     | PB0  12 | 8
- 16  | DIO8  | Data bit 8 (MSB)   | Talker     | PB1  13 | 9
- 17  | REN   | Remote Enabled     | Controller | PC5  28 | A5
- 18  |       | GND DAV            |            |         |
- 19  |       | GND NRFD           |            |         |
- 20  |       | GND NDAC           |            |         |
- 21  |       | GND IFC            |            |         |
- 22  |       | GND SRQ            |            |         |
- 23  |       | GND ATN            |            |         |
- 24  |       | GND data           |            |         |
-
-     | LED   |                    | OUT        | PB5     |
-     |BUZZER | Buzzer PWM (OC1B)  | OUT        | PB2     |
-*/
-
-#define EOI  _BV(PB3)
-#define EOI_PORT B
-#define DAV  _BV(PB4)
-#define DAV_PORT B
-#define NRFD _BV(PC0)
-#define NRFD_PORT C
-#define NDAC _BV(PC1)
-#define NDAC_PORT C
-#define IFC  _BV(PC2)
-#define IFC_PORT C
-#define SRQ  _BV(PC3)
-#define SRQ_PORT C
-#define ATN  _BV(PC4)
-#define ATN_PORT C
-#define REN  _BV(PC5)
-#define REN_PORT C
-
+#define GPIB_RX_RING_SIZE 256 /* must be a power of 2, up to 256 */
+#define GPIB_TRACE_SIZE 64 /* bus trace entries, must be a power of 2 */
+#define PX_DEVICES 4 /* Prologix per-device settings */
+#define PX_HOLD_MS 500 /* the ext mode waits this long for a Prologix line end */
+#define AUTOBAUD_WAIT_MS 3000 /* B6: how long to wait for the 'U' at startup */
+#define AUTOBAUD_DRAIN_MS 100 /* B6: the host's extra 'U's end after this gap */
+
+/* board pins, GPIB pins are in gpib_hal.h */
 #define LED _BV(PB5)
 #define LED_PORT B
+#ifndef UART_RTS_ON_BUZZER
 #define BUZZ _BV(PB2)
 #define BUZZ_PORT B
-
-static void cfg_data_in(void) {
-  DDRD &= ~(_BV(PD2)|_BV(PD3)|_BV(PD4)|_BV(PD5)|_BV(PD6)|_BV(PD7));
-  DDRB &= ~(_BV(PB0)|_BV(PB1));
-}
-static void cfg_data_out(void) {
-  /* DDRD |= (_BV(PD2)|_BV(PD3)|_BV(PD4)|_BV(PD5)|_BV(PD6)|_BV(PD7));
-     DDRB |= (_BV(PB0)|_BV(PB1)); */
-}
-
-static uint8_t data_get(void) {
-  uint8_t d;
-  d = PIND;
-  d >>= 2;
-  if(PINB & _BV(PB0)) d |= 64;
-  if(PINB & _BV(PB1)) d |= 128;
-  return ~d;
-}
-
-static void data_put(uint8_t d) {
-  DDRD = (DDRD&0x3) | (d<<2);
-  SET_PORT_PIN(DDRB, _BV(PB0), d&64);
-  SET_PORT_PIN(DDRB, _BV(PB1), d&128);
-}
-
-static inline void eoi_set(uint8_t x) {SET_PORT_PIN(DDR(EOI_PORT), EOI, (x));}
-static inline void dav_set(uint8_t x) {SET_PORT_PIN(DDR(DAV_PORT), DAV, (x));}
-static inline void nrfd_set(uint8_t x) {SET_PORT_PIN(DDR(NRFD_PORT), NRFD, (x));}
-static inline void ndac_set(uint8_t x) {SET_PORT_PIN(DDR(NDAC_PORT), NDAC, (x));}
-static inline void SetIFC(uint8_t x) {SET_PORT_PIN(DDR(IFC_PORT), IFC, !(x));}
-static inline void set_atn(uint8_t x) {
- SET_PORT_PIN(DDR(ATN_PORT), ATN, (x));
- if(x) _delay_us(0.5); /* T7 in ieee488 spec */
-}
-static inline void set_ren(uint8_t x) {SET_PORT_PIN(DDR(REN_PORT), REN, (x));}
-
-static inline uint8_t dav(void) {return !(PIN(DAV_PORT) & DAV);}
-static inline uint8_t ndac(void) {return !(PIN(NDAC_PORT) & NDAC);}
-static inline uint8_t nrfd(void) {return !(PIN(NRFD_PORT) & NRFD);}
-static inline uint8_t srq(void) {return !(PIN(SRQ_PORT) & SRQ);}
-static inline uint8_t eoi(void) {return !(PIN(EOI_PORT) & EOI);}
-static inline uint8_t ren(void) {return (DDR(REN_PORT) & REN);}
+#endif
 
 const char help[] PROGMEM = 
   "\r\n"
@@ -228,15 +138,28 @@ const char help[] PROGMEM =
   "  THC Send HEX command\r\n"
   "  THD Send*/receive** HEX data\r\n"
   "  TBD Send/receive* HEX data\r\n"
+  "  TBW Send binary data, windowed\r\n"
+  "  TUD Send/receive unbuffered binary data, <ESC> escaped\r\n"
   "  P Continous read (plotter mode), <ESC> to exit\r\n"
+  "  PT[<ms>] Same, with <ESC> escaped and EOI/gap tags\r\n"
   "GPIB control\r\n"
   "  R Set REMOTE mode (REN true)\r\n"
   "  L Set LOCAL mode (REN false)\r\n"
   "  I Generate IFC pulse\r\n"
+  "  Q Parallel poll, returns DIO lines in hex\r\n"
+  "  QC<addr> <line> <sense> Configure parallel poll response (line 1-8)\r\n"
+  "  QU[<addr>] Unconfigure parallel poll, all devices or one\r\n"
   "Other commands\r\n"
   "  S Get REN/SRQ/LISTEN state (1 if true)\r\n"
+  "  B Dump bus trace (binary), BC to clear\r\n"
+  "  U UART errors: frame, overrun, rx ring full, tx stalls. UC to clear\r\n"
   "  O Get/set an option (O? for list)\r\n"
-  "  H Command history\r\n\r\n"
+  "  F Binary framed mode\r\n"
+  "  H Command history\r\n"
+#ifdef GPIB_BENCH
+  "  M<n> Transmit n bytes, show transfer rate\r\n"
+#endif
+  "\r\n"
   "* Add ; at the end to disable EOI\r\n"
   "** You can specify length in hex after the command (up to 7f)\r\n\r\n"
 ;
@@ -249,10 +172,17 @@ const char opt_help[] PROGMEM =
   "  I Interactive mode (0 off, 1 on)\r\n"
   "  C Converter GPIB address\r\n"
   "  D HP3478A GPIB address\r\n"
+  "  dev_sad Its secondary address (31 none)\r\n"
   "  T Transmit end of line*\r\n"
   "  R Receive end of line*\r\n"
   "  X HP3478A extension mode (0 off, 1 on)\r\n"
-  "  B Baud rate (0=115200, 2=500K)\r\n"
+  "  B Baud rate (0=115200, 2=500K, 3=1M, 4=2M, 5=ubrr, 6=auto)\r\n"
+  "  ubrr UART divider for B5, 2MHz/(ubrr+1) baud. B6 detects it at startup\r\n"
+  "  rx_tmo GPIB receive timeout, 0.1ms units (0 none)\r\n"
+  "  tx_tmo GPIB transmit timeout, 0.1ms units (0 none)\r\n"
+  "  trace Record bus trace (0 off, 1 on)\r\n"
+  "  px_addr Prologix mode ++addr at start, px_sad its secondary (31 none).\r\n"
+  "    ++savecfg 1 keeps them updated, the other ++ settings aren't saved\r\n"
   "  0 Set defaults for interactive operation\r\n"
   "  1 Set defaults for non interactive\r\n\r\n"
   "* ORed bits: 4=EOI, 2=<LF>, 1=<CR>\r\n\r\n"
@@ -263,14 +193,19 @@ const char opt_help[] PROGMEM =
 #define GPIB_END_LF  2
 #define GPIB_END_EOI 4
 #define GPIB_END_BUF 8 /* synthetic, used as return value from gpib_receive */
+#define GPIB_RX_MORE 16 /* synthetic, gpib_rx_wait: transfer is not complete yet */
 
 #define GPIB_LISTEN 1
-#define GPIB_TALK   2
 static uint8_t gpib_state = 0;
 static uint8_t gpib_end_seq_tx;
 static uint8_t gpib_end_seq_rx;
 static uint8_t gpib_my_addr;
 static uint8_t gpib_hp3478_addr;
+static uint8_t gpib_hp3478_sad; /* secondary address, GPIB_ADDR_NONE if not used */
+static uint8_t gpib_px_addr; /* the Prologix mode target after ++savecfg */
+static uint8_t gpib_px_sad;
+static uint16_t gpib_rx_tmo; /* 0.1ms units, 0 = no timeout */
+static uint16_t gpib_tx_tmo;
 volatile uint8_t gpib_srq_interrupt;
 
 
@@ -288,6 +223,7 @@ static uint8_t hp3478_disp_err_en;
 
 static uint8_t uart_echo;
 static uint8_t uart_baud;
+static uint16_t uart_ubrr; /* for UART_UBRR and UART_AUTO */
 
 static uint16_t buzz_period;
 static uint8_t buzz_duty;
@@ -329,6 +265,7 @@ static uint8_t buzzer = 0;
 static void 
 beep(uint16_t period, uint8_t duty)
 {
+#ifdef BUZZ
  if(duty) {
   if(!period) PORT(BUZZ_PORT) |= BUZZ;
   else {
@@ -338,6 +275,7 @@ beep(uint16_t period, uint8_t duty)
    TCCR1B = _BV(WGM13)|_BV(CS10);
   }
  }
+#endif
  buzzer = 1;
 }
 
@@ -348,7 +286,9 @@ beep_off(void)
 
  TCCR1B = 0;
  TCCR1A = 0;
+#ifdef BUZZ
  PORT(BUZZ_PORT) &= ~BUZZ;
+#endif
 }
 
 static void
@@ -384,12 +324,82 @@ uart_putchar(char ch, FILE* file)
   return 0;
 }
 
+/* Formatters for the output paths, printf_P is too slow to keep up with
+   the bus. Each stores the text at p and returns the end. */
+static const uint8_t hex_digits[16] PROGMEM = "0123456789ABCDEF";
+static const uint16_t dec_pow10[4] PROGMEM = {10000, 1000, 100, 10};
+
+static uint8_t *
+fmt_hex(uint8_t *p, uint8_t v)
+{
+ *p++ = pgm_read_byte(&hex_digits[v >> 4]);
+ *p++ = pgm_read_byte(&hex_digits[v & 15]);
+ return p;
+}
+
+static uint8_t *
+fmt_dec(uint8_t *p, uint16_t v)
+{
+ uint8_t i, d, lead = 1;
+ uint16_t m;
+
+ for(i = 0; i < 4; i++) {
+  m = pgm_read_word(&dec_pow10[i]);
+  for(d = 0; v >= m; d++) v -= m;
+  if(d || !lead) {
+   *p++ = '0'+d;
+   lead = 0;
+  }
+ }
+ *p++ = '0'+v;
+ return p;
+}
+
+/* prints v and a new line */
+static void
+uart_put_dec(uint16_t v)
+{
+ uint8_t b[7], *p;
+ p = fmt_dec(b, v);
+ *p++ = 13;
+ *p++ = 10;
+ uart_write(b, p-b);
+}
+
+/* Applies the B and ubrr options. The caller should wait at least 2ms
+   after the response before transmitting data with the new rate. */
+static void
+uart_speed_update(void)
+{
+ while(!uart_tx_empty());
+ _delay_ms(1); /* data may remain in registers, wait for transmission */
+ if(uart_baud >= UART_UBRR) uart_set_ubrr(uart_ubrr);
+ else uart_set_speed(uart_baud);
+}
+
+/* prints the UART error counters, see uart.h */
+static void
+uart_err_print(uint8_t clear)
+{
+ uint16_t cnt[UART_ERR_NUM];
+ uint8_t b[UART_ERR_NUM*6+1], *p = b, i;
+
+ uart_err_get(cnt, clear);
+ for(i = 0; i < UART_ERR_NUM; i++) {
+  if(i) *p++ = ' ';
+  p = fmt_dec(p, cnt[i]);
+ }
+ *p++ = 13;
+ *p++ = 10;
+ uart_write(b, p-b);
+}
+
 static void 
 gpib_listen(void)
 {
   cfg_data_in();
 
-  PORT(DAV_PORT) |= DAV; /* enable pullup on DAV so reads won't return garbage */
+  dav_pullup(1);
 
   /* OUTPUTS: IFC | ATN | REN | NRFD | NDAC */
   nrfd_set(1);
@@ -401,29 +411,129 @@ gpib_talk(void)
 {
   cfg_data_out();
   
-  PORT(DAV_PORT) &= ~DAV;
+  dav_pullup(0);
 
   /* OUTPUTS: IFC | ATN | REN | EOI | DAV */
   nrfd_set(0);
   ndac_set(0);
 }
 
+/* GPIB operation timeout.
+   Timer2 ticks every 100us while the timeout runs, the handshake loops only
+   test gpib_tmo. gpib_tmo_restart() is called for every byte; it's cheap
+   unless the timeout has already expired, e.g. while waiting for the UART. */
+static volatile uint8_t gpib_tmo; /* the timeout has expired */
+static volatile uint8_t gpib_tmo_kick;
+static volatile uint16_t gpib_tmo_left;
+static uint16_t gpib_tmo_reload;
+
+ISR(TIMER2_COMPA_vect) {
+  if (gpib_tmo_kick) {
+    gpib_tmo_kick = 0;
+    gpib_tmo_left = gpib_tmo_reload;
+  } else if (!--gpib_tmo_left) {
+    gpib_tmo = 1;
+    TIMSK2 = 0;
+  }
+}
+
+/* t is in 0.1ms units, 0 = no timeout */
+static void
+gpib_tmo_start(uint16_t t)
+{
+  TIMSK2 = 0;
+  gpib_tmo = 0;
+  gpib_tmo_kick = 0;
+  gpib_tmo_reload = t;
+  if (!t) return;
+  gpib_tmo_left = t;
+  TCNT2 = 0;
+  TIFR2 = _BV(OCF2A);
+  TIMSK2 = _BV(OCIE2A);
+}
+
+static inline void
+gpib_tmo_stop(void)
+{
+  TIMSK2 = 0;
+}
+
+static inline void
+gpib_tmo_restart(void)
+{
+  gpib_tmo_kick = 1;
+  /* checked after the kick, so an expiry racing with it isn't lost */
+  if (gpib_tmo) gpib_tmo_start(gpib_tmo_reload);
+}
+
+/* Bus trace.
+   Every handshaked byte is recorded with its direction, ATN/EOI state and
+   a timestamp (ms counter and TCNT0, 4us ticks). Timeouts are recorded
+   too. The ring keeps the last GPIB_TRACE_SIZE entries, B dumps them. */
+#define GPIB_TRACE_ATN 1
+#define GPIB_TRACE_EOI 2
+#define GPIB_TRACE_RX  4 /* received by the converter */
+#define GPIB_TRACE_TMO 8 /* timeout, the data byte is not valid */
+
+struct gpib_trace_ent {
+  uint8_t d;
+  uint8_t flags;
+  uint8_t tick;
+  uint16_t ms;
+};
+static struct gpib_trace_ent gpib_trace_ring[GPIB_TRACE_SIZE];
+static uint8_t gpib_trace_wp;
+static uint8_t gpib_trace_n;
+static uint8_t gpib_trace_on;
+
+/* interrupts must be disabled */
+static void
+gpib_trace_put(uint8_t d, uint8_t flags)
+{
+  uint8_t wp = gpib_trace_wp;
+  struct gpib_trace_ent *e = &gpib_trace_ring[wp];
+
+  e->tick = TCNT0;
+  e->ms = msec_count;
+  if ((TIFR0 & _BV(TOV0)) && e->tick < 125) e->ms++; /* overflow is pending */
+  e->d = d;
+  e->flags = flags;
+  gpib_trace_wp = (wp+1) & (GPIB_TRACE_SIZE-1);
+  if (gpib_trace_n < GPIB_TRACE_SIZE) gpib_trace_n++;
+}
+
+static inline void
+gpib_trace(uint8_t d, uint8_t flags)
+{
+  if (!gpib_trace_on) return;
+  cli();
+  gpib_trace_put(d, flags);
+  sei();
+}
+
+static inline uint8_t
+gpib_trace_bus(void)
+{
+  return (atn() ? GPIB_TRACE_ATN : 0) | (eoi() ? GPIB_TRACE_EOI : 0);
+}
+
 static uint8_t
 gpib_receive(uint8_t *buf, uint8_t buf_size, uint8_t *n_received, uint8_t stop)
 {
   uint8_t index = 0;
   uint8_t c;
   uint8_t do_stop = 0;
-  uint8_t ts;
 
+  gpib_tmo_start(gpib_rx_tmo);
   do {
     nrfd_set(0); /* ready for receiving data */
     
-    ts = (uint8_t)msec_count;
+    gpib_tmo_restart();
     while (!dav()) { /* waiting for falling edge */
-      if ((uint8_t)((uint8_t)msec_count-ts) > GPIB_MAX_RECEIVE_TIMEOUT_mS) {
+      if (gpib_tmo) {
         *n_received = index;
         nrfd_set(1);
+        gpib_trace(0, GPIB_TRACE_RX|GPIB_TRACE_TMO);
         return 0;
       }
     }
@@ -432,6 +542,7 @@ gpib_receive(uint8_t *buf, uint8_t buf_size, uint8_t *n_received, uint8_t stop)
     if (eoi() && (stop & GPIB_END_EOI) != 0) do_stop = GPIB_END_EOI;
     
     c = data_get();
+    gpib_trace(c, GPIB_TRACE_RX|gpib_trace_bus());
     ndac_set(0); /* data accepted */
 
     buf[index++] = c;
@@ -439,133 +550,278 @@ gpib_receive(uint8_t *buf, uint8_t buf_size, uint8_t *n_received, uint8_t stop)
     if (c == 13 && (stop & GPIB_END_CR) != 0) do_stop |= GPIB_END_CR;
 
     while (dav()) { /* waiting for rising edge */
-      if ((uint8_t)((uint8_t)msec_count-ts) > GPIB_MAX_RECEIVE_TIMEOUT_mS) {
+      if (gpib_tmo) {
         *n_received = index;
         ndac_set(1);
+        gpib_trace(0, GPIB_TRACE_RX|GPIB_TRACE_TMO);
         return 0;
       }
     }
     
     ndac_set(1);
   } while (index < buf_size && !do_stop);
+  gpib_tmo_stop();
   *n_received = index;
   if(do_stop) return do_stop;
   return GPIB_END_BUF;
 }
 
+/* gpib_tmo_start(gpib_tx_tmo) must be called before the first byte */
+static inline uint8_t
+gpib_tx_byte(uint8_t d)
+{
+  data_put(d);
+
+  gpib_tmo_restart();
+  while (nrfd()) { /* waiting for high on NRFD */
+    if (gpib_tmo) goto timeout;
+  }
+  _delay_us(2); /* T1 in ieee488 spec, the NRFD wait isn't timed */
+
+  dav_set(1);
+
+  while (ndac()) { /* waiting for high on NDAC */
+    if (gpib_tmo) {
+      dav_set(0);
+      goto timeout;
+    }
+  }
+
+  dav_set(0);
+  gpib_trace(d, gpib_trace_bus());
+  return 1;
+timeout:
+  gpib_trace(d, gpib_trace_bus()|GPIB_TRACE_TMO);
+  return 0;
+}
+
+/* transmit data sources */
+#define GPIB_SRC_RAM  0
+#define GPIB_SRC_PGM  1
+#define GPIB_SRC_EEP  2
+#define GPIB_SRC_UART 3 /* buf is not used, bytes are taken with uart_rx() */
+
+static inline uint8_t
+gpib_src_byte(uint8_t src, const uint8_t *p)
+{
+  switch(src) {
+    case GPIB_SRC_PGM: return pgm_read_byte(p);
+    case GPIB_SRC_EEP: return eeprom_read_byte(p);
+    case GPIB_SRC_UART: return uart_rx();
+  }
+  return *p;
+}
+
+/* Returns the number of bytes transmitted, including the end sequence.
+   For GPIB_SRC_UART, all len bytes are taken from the UART even on timeout. */
 static uint8_t
-gpib_transmit(const uint8_t *buf, uint8_t len, uint8_t end)
+gpib_transmit_src(uint8_t src, const uint8_t *buf, uint8_t len, uint8_t end)
 {
-  uint8_t i;
-  uint8_t ts;
+  uint8_t i = 0, j;
+  uint8_t n = 0; /* bytes taken from the source */
+  uint8_t eoi_at;
+  uint8_t term[2];
+  uint8_t term_len = 0;
   
-  if (!nrfd() && !ndac()) return 0;
+  if (!nrfd() && !ndac()) goto timeout;
+  gpib_tmo_start(gpib_tx_tmo);
+
+  /* resolve the end sequence once, so the loop compares only the index */
+  if(end & GPIB_END_CR) term[term_len++] = 13;
+  if(end & GPIB_END_LF) term[term_len++] = 10;
+  eoi_at = (end & GPIB_END_EOI) != 0 && term_len == 0 ? len-1 : len;
 
-  if(end & GPIB_END_LF) len++;
-  if(end & GPIB_END_CR) len++;
-  
   for(i = 0; i < len; i++) {
-    
-    uint8_t d;
-    if((end & (GPIB_END_LF|GPIB_END_CR)) == (GPIB_END_CR|GPIB_END_LF) && i == len-2) d = 13;
-    else if((end & (GPIB_END_LF|GPIB_END_CR)) == GPIB_END_CR && i == len-1) d = 13;
-    else if((end & GPIB_END_LF) != 0 && i == len-1) d = 10;
-    else d = buf[i];
-
-    data_put(d);
-    if (i == len-1 && (end & GPIB_END_EOI) != 0) eoi_set(1);
-    
-    _delay_us(2); /* T1 in ieee488 spec */
-     
-    ts = (uint8_t)msec_count;
-    while (nrfd()) { /* waiting for high on NRFD */
-      if ((uint8_t)((uint8_t)msec_count-ts) > GPIB_MAX_TRANSMIT_TIMEOUT_mS) {
-        eoi_set(0);
-        cfg_data_in();
-        return i;
-      }
-    }
-    
-    dav_set(1);
-   
-    while (ndac()) { /* waiting for high on NDAC */
-      if ((uint8_t)((uint8_t)msec_count-ts) > GPIB_MAX_TRANSMIT_TIMEOUT_mS) {
-        eoi_set(0);
-        dav_set(0);
-        cfg_data_in();
-        return i;
-      }
-    }
-    
-    dav_set(0);
+    if (i == eoi_at) eoi_set(1);
+    n++;
+    if (!gpib_tx_byte(gpib_src_byte(src, buf+i))) goto timeout;
+  }
+  for(j = 0; j < term_len; j++, i++) {
+    if (j == term_len-1 && (end & GPIB_END_EOI) != 0) eoi_set(1);
+    if (!gpib_tx_byte(term[j])) goto timeout;
   }
+timeout:
+  gpib_tmo_stop();
   eoi_set(0);
   cfg_data_in();
+  if (src == GPIB_SRC_UART) while (n++ < len) (void)uart_rx();
   return i;
 }
 
+static inline uint8_t
+gpib_end_len(uint8_t end)
+{
+  return ((end & GPIB_END_LF) != 0) + ((end & GPIB_END_CR) != 0);
+}
+
 static uint8_t
-gpib_transmit_b(const uint8_t *buf, uint8_t len, uint8_t end)
+gpib_transmit(const uint8_t *buf, uint8_t len, uint8_t end)
 {
-  uint8_t l = len;
-  if(end & GPIB_END_LF) l++;
-  if(end & GPIB_END_CR) l++;
-  return gpib_transmit(buf, len, end) == l;
+  return gpib_transmit_src(GPIB_SRC_RAM, buf, len, end);
 }
 
 static uint8_t
-gpib_transmit_P(const uint8_t *buf, uint8_t len, uint8_t end)
+gpib_transmit_b(const uint8_t *buf, uint8_t len, uint8_t end)
 {
-  uint8_t i;
-  uint8_t ts;
-  
-  if (!nrfd() && !ndac()) return 0;
+  return gpib_transmit_src(GPIB_SRC_RAM, buf, len, end) == len + gpib_end_len(end);
+}
 
-  if(end & GPIB_END_LF) len++;
-  if(end & GPIB_END_CR) len++;
-  
-  for(i = 0; i < len; i++) {
-    
-    uint8_t d;
-    if((end & (GPIB_END_LF|GPIB_END_CR)) == (GPIB_END_CR|GPIB_END_LF) && i == len-2) d = 13;
-    else if((end & (GPIB_END_LF|GPIB_END_CR)) == GPIB_END_CR && i == len-1) d = 13;
-    else if((end & GPIB_END_LF) != 0 && i == len-1) d = 10;
-    else d = pgm_read_byte(buf+i);
-
-    data_put(d);
-    if (i == len-1 && (end & GPIB_END_EOI) != 0) eoi_set(1);
-    
-    _delay_us(2); /* T1 in ieee488 spec */
-     
-    ts = (uint8_t)msec_count;
-    while (nrfd()) { /* waiting for high on NRFD */
-      if ((uint8_t)((uint8_t)msec_count-ts) > GPIB_MAX_TRANSMIT_TIMEOUT_mS) {
-        eoi_set(0);
-        return 0;
-      }
-    }
-    
-    dav_set(1);
-   
-    while (ndac()) { /* waiting for high on NDAC */
-      if ((uint8_t)((uint8_t)msec_count-ts) > GPIB_MAX_TRANSMIT_TIMEOUT_mS) {
-        eoi_set(0);
-        dav_set(0);
+/* Background receive engine.
+   DAV pin change interrupt runs the acceptor side of the three-wire handshake
+   and puts the bytes into a ring, so the bus keeps transferring while the main
+   loop forwards the data to the UART. If the ring is full, NRFD is held until
+   gpib_rx_getc() frees some space. gpib_listen() must be called first. */
+static volatile uint8_t gpib_rx_ring[GPIB_RX_RING_SIZE];
+static volatile uint8_t gpib_rx_wp;
+static volatile uint8_t gpib_rx_rp;
+static volatile uint8_t gpib_rx_end; /* end flags, set when the transfer is complete */
+static volatile uint8_t gpib_rx_hold; /* NRFD is held because the ring is full */
+static volatile uint16_t gpib_rx_left; /* 0 = unlimited */
+static uint8_t gpib_rx_stop;
+
+ISR(GPIB_DAV_vect) {
+  uint8_t c, wp, end;
+
+  if (dav()) {
+    nrfd_set(1); /* not ready for receiving data */
+    end = eoi() ? GPIB_END_EOI : 0;
+    c = data_get();
+    if (gpib_trace_on) gpib_trace_put(c, GPIB_TRACE_RX|(end ? GPIB_TRACE_EOI : 0));
+    wp = gpib_rx_wp;
+    gpib_rx_ring[wp] = c;
+    gpib_rx_wp = (wp+1) & (GPIB_RX_RING_SIZE-1);
+    ndac_set(0); /* data accepted */
+
+    if (c == 10) end |= GPIB_END_LF;
+    if (c == 13) end |= GPIB_END_CR;
+    end &= gpib_rx_stop;
+    if (gpib_rx_left && !--gpib_rx_left) end |= GPIB_END_BUF;
+    gpib_rx_end = end;
+    return;
+  }
+
+  /* DAV is released, complete the handshake */
+  ndac_set(1);
+  if (gpib_rx_end) {
+    dav_irq_disable(); /* leave NRFD asserted until the next gpib_rx_start */
+    return;
+  }
+  if (((gpib_rx_wp+1) & (GPIB_RX_RING_SIZE-1)) == gpib_rx_rp) gpib_rx_hold = 1;
+  else nrfd_set(0); /* ready for receiving data */
+}
+
+static void
+gpib_rx_start(uint8_t stop, uint16_t limit)
+{
+  dav_irq_disable();
+  gpib_rx_wp = 0;
+  gpib_rx_rp = 0;
+  gpib_rx_end = 0;
+  gpib_rx_hold = 0;
+  gpib_rx_left = limit;
+  gpib_rx_stop = stop;
+  dav_irq_enable();
+  nrfd_set(0); /* ready for receiving data */
+}
+
+static void
+gpib_rx_halt(void)
+{
+  dav_irq_disable();
+  nrfd_set(1);
+  ndac_set(1);
+}
+
+/* Waits up to gpib_rx_tmo for data, *n is set to the number of
+   bytes (up to max) to be taken with gpib_rx_getc(). Returns GPIB_RX_MORE if
+   the transfer is still running, end flags when it's complete and these are
+   its last bytes, 0 on timeout. */
+static uint8_t
+gpib_rx_wait(uint8_t max, uint8_t *n)
+{
+  uint8_t rp, avail, end;
+
+  rp = gpib_rx_rp;
+  if (rp == gpib_rx_wp && !gpib_rx_end) {
+    gpib_tmo_start(gpib_rx_tmo);
+    while (rp == gpib_rx_wp && !gpib_rx_end) {
+      if (gpib_tmo) {
+        *n = 0;
+        gpib_trace(0, GPIB_TRACE_RX|GPIB_TRACE_TMO);
         return 0;
       }
     }
-    
-    dav_set(0);
+    gpib_tmo_stop();
   }
-  eoi_set(0);
 
-  return 1;
+  end = gpib_rx_end; /* read before wp, the last byte is stored first */
+  avail = (gpib_rx_wp-rp) & (GPIB_RX_RING_SIZE-1);
+  if (avail > max) {
+    *n = max;
+    return GPIB_RX_MORE;
+  }
+  *n = avail;
+  return end ? end : GPIB_RX_MORE;
+}
+
+static inline uint8_t
+gpib_rx_ready(void)
+{
+  return gpib_rx_rp != gpib_rx_wp || gpib_rx_end;
+}
+
+static uint8_t
+gpib_rx_getc(void)
+{
+  uint8_t rp = gpib_rx_rp;
+  uint8_t c = gpib_rx_ring[rp];
+
+  gpib_rx_rp = (rp+1) & (GPIB_RX_RING_SIZE-1);
+  if (gpib_rx_hold) {
+    gpib_rx_hold = 0;
+    nrfd_set(0); /* ready for receiving data */
+  }
+  return c;
+}
+
+/* Passes n bytes from the ring to the UART, as hex if hex is set. */
+static void
+gpib_rx_to_uart(uint8_t n, uint8_t hex)
+{
+  uint8_t rp = gpib_rx_rp, l, b[32], *p;
+
+  while (n) {
+    if (hex) {
+      l = n > sizeof(b)/2 ? sizeof(b)/2 : n;
+      n -= l;
+      p = b;
+      do {
+        p = fmt_hex(p, gpib_rx_ring[rp]);
+        rp = (rp+1) & (GPIB_RX_RING_SIZE-1);
+      } while (--l);
+      uart_write(b, p-b);
+    } else {
+      /* the bytes up to the end of the ring are contiguous */
+      l = GPIB_RX_RING_SIZE-rp < n ? GPIB_RX_RING_SIZE-rp : n;
+      n -= l;
+      uart_write((const uint8_t *)gpib_rx_ring+rp, l);
+      rp = (rp+l) & (GPIB_RX_RING_SIZE-1);
+    }
+    gpib_rx_rp = rp;
+    if (gpib_rx_hold) {
+      gpib_rx_hold = 0;
+      nrfd_set(0); /* ready for receiving data */
+    }
+  }
 }
 
 ISR(TIMER0_OVF_vect) {
   static uint16_t led_timer;
   uint8_t l = led_state;
   msec_count++;
+#ifdef UART_CTS_PORT
+  uart_cts_poll();
+#endif
   if (l == LED_OFF) return;
 	
   if (++led_timer >= (l == LED_SLOW ? 500 : 100)) {
@@ -574,7 +830,7 @@ ISR(TIMER0_OVF_vect) {
   }
 }
 
-ISR(PCINT1_vect) {
+ISR(GPIB_SRQ_vect) {
   gpib_srq_interrupt = 1;
 }
 
@@ -588,6 +844,47 @@ msec_get(void)
  return v;
 }
 
+#ifdef GPIB_BENCH
+static uint32_t
+usec_get(void)
+{
+ uint16_t ms;
+ uint8_t t;
+ cli();
+ ms = msec_count;
+ t = TCNT0;
+ if((TIFR0 & _BV(TOV0)) && t < 125) ms++; /* overflow is pending */
+ sei();
+ return (uint32_t)ms*1000 + t*4;
+}
+
+/* Transmits n bytes to the addressed listeners in 64 byte calls
+   and reports the rate. */
+static void
+gpib_bench_tx(uint16_t n)
+{
+ uint8_t data[64];
+ uint32_t t, total = 0;
+ uint8_t l, r;
+
+ memset(data, 'A', sizeof(data));
+ t = usec_get();
+ while(n) {
+  l = n > sizeof(data) ? sizeof(data) : n;
+  r = gpib_transmit(data, l, 0);
+  total += r;
+  if(r != l) break;
+  n -= l;
+ }
+ t = usec_get() - t;
+ if(t == 0) t = 1;
+ printf_P(PSTR("%lu bytes %lu us %lu cycles/byte %lu B/s\r\n"),
+          (unsigned long)total, (unsigned long)t,
+          (unsigned long)(total ? t*(F_CPU/1000000)/total : 0),
+          (unsigned long)((uint64_t)total*1000000/t));
+}
+#endif
+
 static uint8_t 
 ishexdigit(uint8_t x)
 {
@@ -628,15 +925,6 @@ convert_hex_message(const uint8_t *buf, uint8_t len, uint8_t *out, uint8_t *out_
   return 1;
 }
 
-static void 
-uart_puts(const uint8_t *s, uint8_t len)
-{
- while(len) {
-  uart_tx(*s);
-  len--;
-  s++;
- }
-}
 
 #define ESC_KEY_UP 0x41
 #define ESC_KEY_DOWN 0x42
@@ -703,7 +991,7 @@ line_edit(uint8_t c, uint8_t *buf, uint8_t *len)
                                   uart_tx(' ');
                                   uart_tx(0x08);
                                  }
-                                 uart_puts(buf, new_cmdlen);
+                                 uart_write(buf, new_cmdlen);
                                  cmdlen = new_cmdlen;
                                  cursor = new_cmdlen;
                                  break;
@@ -773,7 +1061,7 @@ line_edit(uint8_t c, uint8_t *buf, uint8_t *len)
                    cmdlen++;
                    if(uart_echo) {
                     uart_tx(c);
-                    uart_puts(buf+cursor, cmdlen-cursor);
+                    uart_write(buf+cursor, cmdlen-cursor);
                     for (i=cursor; i<cmdlen; i++) uart_tx(0x08);
                    }
  }
@@ -794,6 +1082,19 @@ line_edit(uint8_t c, uint8_t *buf, uint8_t *len)
  return cmd;
 }
 
+static uint16_t
+read_dec(const char *buf, uint8_t len)
+{
+ uint16_t val = 0;
+ while(len) {
+  char ch = *buf++;
+  if(ch < '0' || ch > '9') return val;
+  val = val*10 + (ch-'0');
+  len--;
+ }
+ return val;
+}
+
 static uint8_t 
 get_read_length(const uint8_t *buf, uint8_t len) 
 {
@@ -839,7 +1140,7 @@ const struct opt_info PROGMEM opts[] = {
   .max = 7,  .def = EEP_DEF0_GPIB_END_SEQ_TX,
   .addr = &gpib_end_seq_tx,      .addr_eep = (void*)EEP_ADDR_GPIB_END_SEQ_TX},
  {.name = "B",
-  .max = 4, .def = EEP_DEF0_UART_BAUD,
+  .max = UART_AUTO, .def = EEP_DEF0_UART_BAUD,
   .addr = &uart_baud,            .addr_eep = (void*)EEP_ADDR_UART_BAUD},
  {.name = "init_mode",
   .max = 0x7fff,.def = EEP_DEF0_MODE,         .flags = OPT_INFO_W16,
@@ -847,6 +1148,27 @@ const struct opt_info PROGMEM opts[] = {
  {.name = "init_ext_mode",
   .max = INIT_EXT_MODE_MAX,.def = EEP_DEF0_EXT_MODE,
   .addr = &hp3478_init_ext_mode, .addr_eep = (void*)EEP_ADDR_EXT_MODE},
+ {.name = "rx_tmo",
+  .max = 65534, .def = EEP_DEF0_GPIB_RX_TMO, .flags = OPT_INFO_W16,
+  .addr = &gpib_rx_tmo,          .addr_eep = (void*)EEP_ADDR_GPIB_RX_TMO},
+ {.name = "tx_tmo",
+  .max = 65534, .def = EEP_DEF0_GPIB_TX_TMO, .flags = OPT_INFO_W16,
+  .addr = &gpib_tx_tmo,          .addr_eep = (void*)EEP_ADDR_GPIB_TX_TMO},
+ {.name = "dev_sad",
+  .max = 31, .def = EEP_DEF0_GPIB_HP3478_SAD,
+  .addr = &gpib_hp3478_sad,      .addr_eep = (void*)EEP_ADDR_GPIB_HP3478_SAD},
+ {.name = "trace",
+  .max = 1, .def = EEP_DEF0_GPIB_TRACE,
+  .addr = &gpib_trace_on,        .addr_eep = (void*)EEP_ADDR_GPIB_TRACE},
+ {.name = "ubrr",
+  .max = 4095, .def = EEP_DEF0_UART_UBRR, .flags = OPT_INFO_W16,
+  .addr = &uart_ubrr,            .addr_eep = (void*)EEP_ADDR_UART_UBRR},
+ {.name = "px_addr",
+  .max = 30, .def = EEP_DEF0_GPIB_PX_ADDR,
+  .addr = &gpib_px_addr,         .addr_eep = (void*)EEP_ADDR_GPIB_PX_ADDR},
+ {.name = "px_sad",
+  .max = 31, .def = EEP_DEF0_GPIB_PX_SAD,
+  .addr = &gpib_px_sad,          .addr_eep = (void*)EEP_ADDR_GPIB_PX_SAD},
  {.name = "beep_period",
   .max = 65534,  .def = EEP_DEF0_BEEP_PERIOD, .flags = OPT_INFO_W16,
   .addr = &buzz_period,          .addr_eep = (void*)EEP_ADDR_BEEP_PERIOD},
@@ -911,6 +1233,26 @@ get_opt_info(const uint8_t *buf, uint8_t len, struct opt_info *ret)
 }
 
 
+static uint16_t
+opt_get(const struct opt_info *opt)
+{
+ if(opt->flags & OPT_INFO_W16) return *(uint16_t*)opt->addr;
+ return *(uint8_t*)opt->addr;
+}
+
+/* w: also save it to the EEPROM */
+static void
+opt_set(const struct opt_info *opt, uint16_t v, uint8_t w)
+{
+ if(opt->flags & OPT_INFO_W16) {
+  *(uint16_t*)opt->addr = v;
+  if(w) eeprom_write_word(opt->addr_eep, v);
+ } else {
+  *(uint8_t*)opt->addr = (uint8_t)v;
+  if(w) eeprom_write_byte(opt->addr_eep, (uint8_t)v);
+ }
+}
+
 static uint8_t 
 get_set_opt(const uint8_t *buf, uint8_t len)
 {
@@ -979,65 +1321,503 @@ get_set_opt(const uint8_t *buf, uint8_t len)
                   
  }
 
- if(len == 0) {
-  unsigned val;
-  if(opt.flags & OPT_INFO_W16) val = *(uint16_t*)opt.addr;
-  else val = *(uint8_t*)opt.addr;
-  printf_P(PSTR("%u\r\n"), val);
-  return 0;
- }
+ if(len == 0) {
+  uart_put_dec(opt_get(&opt));
+  return 0;
+ }
+
+ for(i = 0, v = 0; i < len; i++) {
+  uint8_t c = buf[i];
+  
+  if(c > '9' || c < '0') {
+   if((c == 'w' || c == 'W') && i == len-1) {
+    w = 1;
+    break;
+   }
+   printf_P(PSTR("ERROR\r\n"));
+   return 0;
+  }
+  v = v*10 + (c-'0');
+ }
+ if(v > opt.max) {
+  printf_P(PSTR("ERROR\r\n"));
+  return 0;
+ }
+
+ opt_set(&opt, v, w);
+ printf_P(PSTR("OK\r\n"));
+ return 1;
+}
+
+/* Bus addressing cache.
+   The talker and the listeners other than the converter, as set by the
+   commands sent so far, so address bytes already in effect can be skipped.
+   The converter's own listen state is gpib_state. A device's own talk
+   address may leave it listening (only the L4 subset unaddresses it), so
+   it stays in the listeners and the next addressing starts with UNL; its
+   listen address makes the talker unknown the same way. A secondary
+   address is kept for the talker and for the listener addressed last. */
+#define GPIB_ADDR_NONE 31
+#define GPIB_ADDR_UNKNOWN 0xff
+#define GPIB_ADDR_BIT(a) ((uint32_t)1 << (a))
+static uint8_t gpib_talker = GPIB_ADDR_UNKNOWN;
+static uint8_t gpib_talker_sad = GPIB_ADDR_NONE;
+static uint32_t gpib_listeners = 0x7fffffff; /* any may listen, UNL first */
+static uint8_t gpib_listener_pad = GPIB_ADDR_NONE;
+static uint8_t gpib_listener_sad;
+
+static void
+gpib_addr_unknown(void)
+{
+ gpib_talker = GPIB_ADDR_UNKNOWN;
+ gpib_listeners = 0x7fffffff;
+}
+
+static void
+gpib_addr_clear(void) /* after IFC */
+{
+ gpib_talker = GPIB_ADDR_NONE;
+ gpib_listeners = 0;
+}
+
+static void
+gpib_state_from_cmd(const uint8_t *buf, uint8_t len)
+{
+ uint8_t prev = 0; /* the primary address a secondary applies to */
+ uint8_t i;
+ uint8_t b, a;
+
+ for (i=0; i<len; i++) {
+  b = buf[i];
+  a = b & 0x1f;
+  if (b == '?') {
+   gpib_listeners = 0;
+   gpib_listener_pad = GPIB_ADDR_NONE;
+  } else if (b == '_') {
+   gpib_talker = GPIB_ADDR_NONE;
+  } else if (b >= 32 && b < 63) {
+   if (a != gpib_my_addr) gpib_listeners |= GPIB_ADDR_BIT(a);
+   if (gpib_talker == a) gpib_talker = a == gpib_my_addr ? GPIB_ADDR_NONE : GPIB_ADDR_UNKNOWN;
+   gpib_listener_pad = GPIB_ADDR_NONE;
+  } else if (b >= 64 && b < 95) {
+   gpib_talker = a;
+   gpib_talker_sad = GPIB_ADDR_NONE;
+  } else if (b >= 96 && b < 127) {
+   if (prev >= 32 && prev < 63) {
+    gpib_listener_pad = prev & 0x1f;
+    gpib_listener_sad = a;
+   } else if (prev >= 64 && prev < 95) {
+    gpib_talker_sad = a;
+   }
+  }
+  prev = b;
+  if (b == '?' || b == 64+gpib_my_addr) {
+   gpib_state = 0;
+  } else if (b == 32+gpib_my_addr) {
+   gpib_state = GPIB_LISTEN;
+  }
+ }
+}
+
+/* Sends bus commands with ATN, the converter's lines and the addressing
+   cache follow the addresses sent. */
+static uint8_t
+gpib_send_cmd(const uint8_t *cmd, uint8_t len)
+{
+ uint8_t r;
+
+ /* ATN first: a talker waiting for NRFD release would take the
+    handshake lines going up as the acceptance of its byte */
+ set_atn(1);
+ if(gpib_state == GPIB_LISTEN) gpib_talk();
+ gpib_state_from_cmd(cmd, len);
+ r = gpib_transmit_b(cmd, len, 0);
+ set_atn(0);
+ if(!r) gpib_addr_unknown();
+ if(gpib_state == GPIB_LISTEN) gpib_listen();
+ return r;
+}
+
+/* Puts the address bytes needed to make talker and listener the only
+   addressed devices into cmd (up to 4), returns the count. sad is the
+   secondary address of the one that isn't the converter, or
+   GPIB_ADDR_NONE. */
+static uint8_t
+gpib_address_cmd(uint8_t talker, uint8_t listener, uint8_t sad, uint8_t *cmd)
+{
+ uint8_t len = 0;
+ uint32_t l = gpib_listeners;
+
+ if(listener == gpib_my_addr) {
+  if(l) cmd[len++] = '?';
+  if(l || gpib_state != GPIB_LISTEN) cmd[len++] = listener+GPIB_LISTEN_ADDR_OFFSET;
+ } else {
+  /* MTA unaddresses the converter as a listener, no need for UNL */
+  if((l & ~GPIB_ADDR_BIT(listener)) || (gpib_state == GPIB_LISTEN && talker != gpib_my_addr)) {
+   cmd[len++] = '?';
+   l = 0;
+  }
+  if(!(l & GPIB_ADDR_BIT(listener))
+     || (sad != GPIB_ADDR_NONE && (gpib_listener_pad != listener || gpib_listener_sad != sad))) {
+   cmd[len++] = listener+GPIB_LISTEN_ADDR_OFFSET;
+   if(sad != GPIB_ADDR_NONE) cmd[len++] = sad+GPIB_SECONDARY_ADDR_OFFSET;
+  }
+ }
+ if(talker == gpib_my_addr) {
+  if(gpib_talker != talker) cmd[len++] = talker+GPIB_TALK_ADDR_OFFSET;
+ } else if(gpib_talker != talker || gpib_talker_sad != sad) {
+  cmd[len++] = talker+GPIB_TALK_ADDR_OFFSET;
+  if(sad != GPIB_ADDR_NONE) cmd[len++] = sad+GPIB_SECONDARY_ADDR_OFFSET;
+ }
+ return len;
+}
+
+static uint8_t
+gpib_address(uint8_t talker, uint8_t listener, uint8_t sad)
+{
+ uint8_t cmd[4];
+ uint8_t len = gpib_address_cmd(talker, listener, sad, cmd);
+
+ return len ? gpib_send_cmd(cmd, len) : 1;
+}
+
+#define GPIB_UNL 1
+#define GPIB_UNT 2
+
+/* Sends UNL and/or UNT unless already in effect, the converter stops
+   listening in either case. */
+static uint8_t
+gpib_unaddress(uint8_t what)
+{
+ uint8_t cmd[2];
+ uint8_t len = 0;
+
+ if((what & GPIB_UNL) && gpib_listeners) cmd[len++] = '?';
+ if((what & GPIB_UNT) && gpib_talker != GPIB_ADDR_NONE) cmd[len++] = '_';
+ if(len && !gpib_send_cmd(cmd, len)) return 0;
+ if(gpib_state == GPIB_LISTEN) {
+  gpib_talk();
+  gpib_state = 0;
+ }
+ return 1;
+}
+
+static void
+gpib_ifc(void)
+{
+ SetIFC(0);
+ _delay_ms(1);
+ SetIFC(1);
+ gpib_addr_clear();
+ if(gpib_state == GPIB_LISTEN) {
+  gpib_state = 0;
+  led_set(LED_OFF);
+  gpib_talk();
+ }
+}
+
+#define GPIB_SDC 0x04
+#define GPIB_GET 0x08
+#define GPIB_SPE 0x18
+#define GPIB_SPD 0x19
+
+/* Serial polls a device, *sb gets its status byte. The device is left
+   unaddressed unless the converter was listening. Returns 0, or the step
+   that failed: 1 SPE and addressing, 2 the status byte, 3 SPD and UNT. */
+static uint8_t
+gpib_serial_poll(uint8_t addr, uint8_t sad, uint8_t *sb)
+{
+ uint8_t cmd[5];
+ uint8_t rl, err;
+ uint8_t st = gpib_state;
+
+ cmd[0] = GPIB_SPE;
+ err = 1;
+ if(!gpib_send_cmd(cmd, 1+gpib_address_cmd(addr, gpib_my_addr, sad, cmd+1))) goto fail;
+ err = 2;
+ gpib_receive(sb, 1, &rl, 0);
+ if(rl != 1) goto fail;
+ err = 3;
+ cmd[0] = GPIB_SPD;
+ if(!gpib_send_cmd(cmd, 1)) goto fail;
+ if(st != GPIB_LISTEN && !gpib_unaddress(GPIB_UNT)) goto fail;
+ return 0;
+fail:
+ gpib_talk();
+ set_atn(0);
+ gpib_state = 0;
+ gpib_addr_unknown();
+ return err;
+}
+
+/* Parallel poll: ATN with EOI (IDY), each configured device answers on
+   its DIO line, so up to 8 devices are polled in one bus cycle. */
+static uint8_t
+gpib_parallel_poll(void)
+{
+ uint8_t d;
+
+ cfg_data_in();
+ set_atn(1);
+ eoi_set(1);
+ _delay_us(2); /* T6 in ieee488 spec */
+ d = data_get();
+ eoi_set(0);
+ set_atn(0);
+ return d;
+}
+
+#define GPIB_PPC 0x05
+#define GPIB_PPU 0x15
+#define GPIB_PPE 0x60 /* | sense<<3 | line-1 */
+#define GPIB_PPD 0x70
+
+/* Sends PPC with PPE/PPD to one device, or PPU to all if addr > 30.
+   The bus is unlistened before and after. */
+static uint8_t
+gpib_pp_config(uint8_t addr, uint8_t ppe)
+{
+ uint8_t cmd[5];
+ uint8_t len = 1;
+
+ if(addr > 30) {
+  cmd[0] = GPIB_PPU;
+ } else {
+  cmd[0] = '?';
+  cmd[1] = addr+GPIB_LISTEN_ADDR_OFFSET;
+  cmd[2] = GPIB_PPC;
+  cmd[3] = ppe;
+  cmd[4] = '?';
+  len = 5;
+ }
+ return gpib_send_cmd(cmd, len);
+}
+
+/* reads up to n decimal numbers separated by spaces or commas,
+   returns the count */
+static uint8_t
+read_dec_list(const uint8_t *buf, uint8_t len, uint16_t *v, uint8_t n)
+{
+ uint8_t i = 0;
+
+ while(len && i < n) {
+  if(*buf == ' ' || *buf == ',') {
+   buf++;
+   len--;
+   continue;
+  }
+  if(*buf < '0' || *buf > '9') break;
+  v[i] = 0;
+  while(len && *buf >= '0' && *buf <= '9') {
+   v[i] = v[i]*10 + (*buf++ - '0');
+   len--;
+  }
+  i++;
+ }
+ return len ? 0 : i;
+}
+
+/* Framed mode (F command).
+   Binary frames with a sequence number and a CRC, so a host can queue
+   requests and detect corrupted data. The CRC is CRC-16/XMODEM (LE) over
+   everything after the sync byte.
+     request:  A5 op seq len data[len] crc
+     response: A5 op seq st len data[len] crc
+   seq is copied from the request. st is one of FRM_ST_*; a request with a
+   bad CRC or length is answered with FRM_ST_CRC, the data is ignored.
+   A request must arrive with no gap over FRM_BYTE_TMO ms between bytes.
+     C  data: bytes to send with ATN       resp: len, 0 on timeout
+     D  data: end flags, bytes to send     resp: number of bytes sent
+     R  data: [max length, 0 = 254]        resp: end flags, received bytes
+     S                                     resp: REN, SRQ, LISTEN (0/1)
+     E  data: REN (0/1)
+     O  data: name[, 0, value LE[, 1 to save]]  resp: value LE
+     X  leave framed mode
+   End flags are GPIB_END_*; a D request uses them instead of the T option,
+   an R request ends as configured with the R option or at max length.
+   The ext mode and SRQ aren't serviced until X, the host sees SRQ with S.
+   An SRQ still asserted after X is handled then. */
+#define FRM_SYN 0xa5
+#define FRM_BYTE_TMO 50
+#define FRM_ST_OK 0
+#define FRM_ST_TIMEOUT 1
+#define FRM_ST_ERROR 2
+#define FRM_ST_CRC 3
+
+static uint16_t frm_crc;
+
+static void
+frm_put(const uint8_t *p, uint8_t len)
+{
+ uint8_t i;
+ for(i = 0; i < len; i++) frm_crc = _crc_xmodem_update(frm_crc, p[i]);
+ uart_write(p, len);
+}
+
+static void
+frm_start(uint8_t op, uint8_t seq, uint8_t st, uint8_t len)
+{
+ uint8_t h[4] = {op, seq, st, len};
+ uart_tx(FRM_SYN);
+ frm_crc = 0;
+ frm_put(h, 4);
+}
+
+static void
+frm_end(void)
+{
+ uart_tx(frm_crc);
+ uart_tx(frm_crc >> 8);
+}
+
+static void
+frm_reply(uint8_t op, uint8_t seq, uint8_t st, const uint8_t *p, uint8_t len)
+{
+ frm_start(op, seq, st, len);
+ frm_put(p, len);
+ frm_end();
+}
 
- for(i = 0, v = 0; i < len; i++) {
-  uint8_t c = buf[i];
-  
-  if(c > '9' || c < '0') {
-   if((c == 'w' || c == 'W') && i == len-1) {
-    w = 1;
-    break;
-   }
-   printf_P(PSTR("ERROR\r\n"));
-   return 0;
+/* -1 if nothing arrives in FRM_BYTE_TMO ms */
+static int16_t
+frm_getc(void)
+{
+ uint16_t t = msec_get();
+ while(uart_rx_empty()) if((uint16_t)(msec_get()-t) > FRM_BYTE_TMO) return -1;
+ return uart_rx();
+}
+
+/* R request: the transfer is limited to the ring size, so it's complete
+   before the response header with its length is sent; the end flags byte
+   and the data must fit in the 8-bit length */
+static void
+frm_read(uint8_t seq, uint8_t max)
+{
+ uint8_t wp, rp, n, l, end;
+
+ if(max == 0 || max > GPIB_RX_RING_SIZE-2) max = GPIB_RX_RING_SIZE-2;
+ gpib_rx_start(gpib_end_seq_rx, max);
+ gpib_tmo_start(gpib_rx_tmo);
+ wp = gpib_rx_wp;
+ while(!gpib_rx_end && !gpib_tmo) {
+  if(gpib_rx_wp != wp) {
+   wp = gpib_rx_wp;
+   gpib_tmo_restart();
   }
-  v = v*10 + (c-'0');
- }
- if(v > opt.max) {
-  printf_P(PSTR("ERROR\r\n"));
-  return 0;
  }
-
- if(opt.flags & OPT_INFO_W16) {
-  *(uint16_t*)opt.addr = (uint16_t)v;
-  if(w) eeprom_write_word(opt.addr_eep, (uint16_t)v);
- } else {
-  *(uint8_t*)opt.addr = (uint8_t)v;
-  if(w) eeprom_write_byte(opt.addr_eep, (uint8_t)v);
+ gpib_tmo_stop();
+ end = gpib_rx_end; /* read before wp, the last byte is stored first */
+ gpib_rx_halt();
+ if(!end) gpib_trace(0, GPIB_TRACE_RX|GPIB_TRACE_TMO);
+ rp = gpib_rx_rp;
+ n = (gpib_rx_wp-rp) & (GPIB_RX_RING_SIZE-1);
+ frm_start('R', seq, end ? FRM_ST_OK : FRM_ST_TIMEOUT, n+1);
+ frm_put(&end, 1);
+ while(n) {
+  l = GPIB_RX_RING_SIZE-rp < n ? GPIB_RX_RING_SIZE-rp : n;
+  frm_put((const uint8_t *)gpib_rx_ring+rp, l);
+  n -= l;
+  rp = (rp+l) & (GPIB_RX_RING_SIZE-1);
  }
- printf_P(PSTR("OK\r\n"));
- return 1;
+ frm_end();
 }
 
 static void
-gpib_state_from_cmd(const uint8_t *buf, uint8_t len)
+framed_loop(uint8_t *buf)
 {
- uint8_t i;
- uint8_t b;
-                   
- for (i=0; i<len; i++) {
-  b = buf[i];
-                    if (b == '?' || b == 64+gpib_my_addr) {
-                     gpib_state = 0;
-                     led_set(LED_OFF);
-                    } else if (b == 32+gpib_my_addr) {
-                     gpib_state = GPIB_LISTEN;
-                     led_set(LED_FAST);
-                    }
+ uint8_t h[3], i, op, seq, len, st, r[3];
+ uint16_t crc;
+ int16_t c;
+
+ frm_reply('F', 0, FRM_ST_OK, 0, 0);
+ while(1) {
+  if(uart_rx() != FRM_SYN) continue;
+  crc = 0;
+  for(i = 0; i < 3; i++) {
+   if((c = frm_getc()) < 0) break;
+   h[i] = c;
+   crc = _crc_xmodem_update(crc, c);
+  }
+  if(i != 3) continue;
+  op = h[0];
+  seq = h[1];
+  len = h[2];
+  if(len > CMD_BUF_SIZE) {
+   frm_reply(op, seq, FRM_ST_CRC, 0, 0);
+   continue;
+  }
+  for(i = 0; i < len+2; i++) {
+   if((c = frm_getc()) < 0) break;
+   if(i < len) {
+    buf[i] = c;
+    crc = _crc_xmodem_update(crc, c);
+   } else crc ^= (uint16_t)c << (i == len ? 0 : 8);
+  }
+  if(c < 0) continue;
+  if(crc) {
+   frm_reply(op, seq, FRM_ST_CRC, 0, 0);
+   continue;
+  }
+
+  st = FRM_ST_ERROR;
+  switch(op) {
+          case 'C':
+                  r[0] = gpib_send_cmd(buf, len) ? len : 0;
+                  led_set(gpib_state == GPIB_LISTEN ? LED_FAST : LED_OFF);
+                  frm_reply(op, seq, r[0] == len ? FRM_ST_OK : FRM_ST_TIMEOUT, r, 1);
+                  continue;
+          case 'D':
+                  if(len == 0 || gpib_state == GPIB_LISTEN) break;
+                  r[0] = gpib_transmit(buf+1, len-1, buf[0]);
+                  st = r[0] == len-1+gpib_end_len(buf[0]) ? FRM_ST_OK : FRM_ST_TIMEOUT;
+                  if(r[0] > len-1) r[0] = len-1;
+                  frm_reply(op, seq, st, r, 1);
+                  continue;
+          case 'R':
+                  if(gpib_state != GPIB_LISTEN) break;
+                  frm_read(seq, len ? buf[0] : 0);
+                  continue;
+          case 'S':
+                  r[0] = ren() != 0;
+                  r[1] = srq() != 0;
+                  r[2] = gpib_state == GPIB_LISTEN;
+                  frm_reply(op, seq, FRM_ST_OK, r, 3);
+                  continue;
+          case 'E':
+                  if(len != 1 || buf[0] > 1) break;
+                  set_ren(buf[0]);
+                  frm_reply(op, seq, FRM_ST_OK, 0, 0);
+                  continue;
+          case 'O': {
+                  struct opt_info opt;
+                  uint16_t v;
+                  i = get_opt_info(buf, len, &opt);
+                  if(!i) break;
+                  if(i < len) {
+                   if(len < i+3 || buf[i] != 0) break;
+                   v = buf[i+1] | (uint16_t)buf[i+2] << 8;
+                   if(v > opt.max) break;
+                   opt_set(&opt, v, len > i+3 && buf[i+3]);
+                  }
+                  v = opt_get(&opt);
+                  r[0] = v;
+                  r[1] = v >> 8;
+                  frm_reply(op, seq, FRM_ST_OK, r, 2);
+                  if((opt.addr == &uart_baud || opt.addr == &uart_ubrr) && i < len)
+                   uart_speed_update();
+                  continue;
+          }
+          case 'X':
+                  frm_reply(op, seq, FRM_ST_OK, 0, 0);
+                  return;
+  }
+  frm_reply(op, seq, st, 0, 0);
  }
 }
 
 static uint8_t 
 command_handler(uint8_t command, uint8_t *buf, uint8_t len)
 {
-  uint8_t gpib_buf[GPIB_BUF_SIZE];
   uint8_t gpib_len;
   uint8_t i;
   uint8_t send_eoi;
@@ -1047,10 +1827,12 @@ command_handler(uint8_t command, uint8_t *buf, uint8_t len)
            case 'D': /* send/receive ASCII */
                    if (gpib_state == GPIB_LISTEN) {
                     uart_rx_esc_char(); /* clear previous escape */
+                    gpib_rx_start(gpib_end_seq_rx, 0);
                     do {
-                     result = gpib_receive(gpib_buf, GPIB_BUF_SIZE, &gpib_len, gpib_end_seq_rx);
-                     uart_puts(gpib_buf, gpib_len);
-                    } while(result == GPIB_END_BUF && !uart_rx_esc_char());
+                     result = gpib_rx_wait(0xff, &gpib_len);
+                     gpib_rx_to_uart(gpib_len, 0);
+                    } while(result == GPIB_RX_MORE && !uart_rx_esc_char());
+                    gpib_rx_halt();
                     if(result == 0) printf_P(PSTR("\r\n")); /* no EOI or EOL received, ensure user receives
                                                                at least an empty line */
                     break;
@@ -1063,6 +1845,7 @@ command_handler(uint8_t command, uint8_t *buf, uint8_t len)
                    break;
            case 'C': /* send ASCII command */
                    gpib_state_from_cmd(buf+1, len-1); 
+                   led_set(gpib_state == GPIB_LISTEN ? LED_FAST : LED_OFF);
 
                    gpib_talk();
 
@@ -1070,7 +1853,10 @@ command_handler(uint8_t command, uint8_t *buf, uint8_t len)
                    result = gpib_transmit(buf+1, len-1, 0);
 
                    if (result == len-1) printf_P(PSTR("OK\r\n"));
-                   else printf_P(PSTR("TIMEOUT %d\r\n"), (unsigned) result);
+                   else {
+                    printf_P(PSTR("TIMEOUT %d\r\n"), (unsigned) result);
+                    gpib_addr_unknown();
+                   }
 
                    set_atn(0);
 
@@ -1086,14 +1872,7 @@ command_handler(uint8_t command, uint8_t *buf, uint8_t len)
                    printf_P(PSTR("OK\r\n"));
                    break;
            case 'I':
-                   SetIFC(0);
-                   _delay_ms(1);
-                   SetIFC(1);
-                   if (gpib_state == GPIB_LISTEN) {
-                    gpib_state = 0;
-                    led_set(LED_OFF);
-                    gpib_talk();
-                   }
+                   gpib_ifc();
                    printf_P(PSTR("OK\r\n"));
                    break;
            case 'S':
@@ -1104,20 +1883,106 @@ command_handler(uint8_t command, uint8_t *buf, uint8_t len)
                    uart_tx(10);
                    break;
 
-           case 'P':
-                   led_set(LED_SLOW);
-                   gpib_listen();
-
-                   uart_rx_esc_char();
-                   while (!uart_rx_esc_char()) {
-                    result = gpib_receive(gpib_buf, 1, &gpib_len, 0);
-                    if(gpib_len == 0) _delay_ms(10);
-                    else uart_tx(gpib_buf[0]);
+           case 'P': /* P plotter mode, PT[<gap ms>] tagged: <ESC> in data is doubled,
+                        <ESC>E follows EOI, <ESC>G a gap in the data (100ms by default),
+                        <ESC>X ends the output */
+                   {
+                    uint8_t tag = len > 1 && buf[1] == 'T';
+                    uint16_t gap = 100, last = 0;
+                    uint8_t idle = 1, esc = 0;
+                    if(tag && len > 2) gap = read_dec((const char*)buf+2, len-2);
+
+                    led_set(LED_SLOW);
+                    gpib_listen();
+
+                    uart_rx_esc_char();
+                    gpib_rx_start(tag ? GPIB_END_EOI : 0, 0);
+                    while (!uart_rx_esc_char()) {
+                     if(!gpib_rx_ready()) {
+                      if(tag && !idle && gap && (uint16_t)(msec_get()-last) >= gap) {
+                       uart_tx(27);
+                       uart_tx('G');
+                       idle = 1;
+                      }
+                      continue;
+                     }
+                     result = gpib_rx_wait(0xff, &gpib_len);
+                     while(gpib_len--) {
+                      uint8_t c = gpib_rx_getc();
+                      if(tag && c == 27) uart_tx(27);
+                      uart_tx(c);
+                     }
+                     if(result & GPIB_END_EOI) {
+                      uart_tx(27);
+                      uart_tx('E');
+                      /* the talker may still hold DAV, its release must not
+                         fall into the restart, which clears the pending edge.
+                         With rx_tmo 0 only <ESC> ends the wait. */
+                      gpib_tmo_start(gpib_rx_tmo);
+                      while(dav() && !gpib_tmo && !(esc = uart_rx_esc_char()));
+                      gpib_tmo_stop();
+                      if(esc) break;
+                      gpib_rx_halt();
+                      gpib_rx_start(GPIB_END_EOI, 0);
+                     }
+                     last = msec_get();
+                     idle = 0;
+                    }
+                    gpib_rx_halt();
+                    if(tag) {
+                     uart_tx(27);
+                     uart_tx('X');
+                    }
                    }
                    gpib_state = 0;
                    gpib_talk();
                    led_set(LED_OFF);
                    break;
+           case 'Q': /* Q parallel poll, QC<addr> <line> <sense> configure,
+                        QU unconfigure all, QU<addr> unconfigure one */
+                   if(len == 1) {
+                    printf_P(PSTR("%02X\r\n"), gpib_parallel_poll());
+                   } else {
+                    uint16_t v[3];
+                    uint8_t n = read_dec_list(buf+2, len-2, v, 3);
+                    if(buf[1] == 'C' && n == 3 && v[0] <= 30 && v[1] >= 1 && v[1] <= 8 && v[2] <= 1) {
+                     result = gpib_pp_config(v[0], GPIB_PPE | v[2]<<3 | (v[1]-1));
+                    } else if(buf[1] == 'U' && len == 2) {
+                     result = gpib_pp_config(31, 0);
+                    } else if(buf[1] == 'U' && n == 1 && v[0] <= 30) {
+                     result = gpib_pp_config(v[0], GPIB_PPD);
+                    } else {
+                     printf_P(PSTR("ERROR\r\n"));
+                     break;
+                    }
+                    if(result) printf_P(PSTR("OK\r\n"));
+                    else printf_P(PSTR("TIMEOUT\r\n"));
+                   }
+                   break;
+           case 'B': /* B dump bus trace, BC clear */
+                   if(len == 2 && buf[1] == 'C') {
+                    gpib_trace_n = 0;
+                    printf_P(PSTR("OK\r\n"));
+                   } else if(len == 1) {
+                    /* binary: entry count, then oldest first: data, flags, tick, ms (LE) */
+                    uint8_t n = gpib_trace_n;
+                    uint8_t rp = (gpib_trace_wp-n) & (GPIB_TRACE_SIZE-1);
+                    uart_tx(n);
+                    while(n--) {
+                     const struct gpib_trace_ent *e = &gpib_trace_ring[rp];
+                     uart_tx(e->d);
+                     uart_tx(e->flags);
+                     uart_tx(e->tick);
+                     uart_tx(e->ms);
+                     uart_tx(e->ms >> 8);
+                     rp = (rp+1) & (GPIB_TRACE_SIZE-1);
+                    }
+                   } else printf_P(PSTR("ERROR\r\n"));
+                   break;
+           case 'U': /* U UART error counters, UC also clears them */
+                   if(len == 1 || (len == 2 && buf[1] == 'C')) uart_err_print(len == 2);
+                   else printf_P(PSTR("ERROR\r\n"));
+                   break;
            case '?':
                    printf_P(help);
                    break;
@@ -1133,27 +1998,33 @@ command_handler(uint8_t command, uint8_t *buf, uint8_t len)
                     break; 
                    }
                    if(buf[1] == 'H' && (gpib_state != GPIB_LISTEN || buf[2] == 'C')) { /* HEX tx command & data */
-                     if (!convert_hex_message(buf+3, len-3, gpib_buf, &gpib_len, &send_eoi)) {
+                     /* converted in place, the output is shorter than the input */
+                     if (!convert_hex_message(buf+3, len-3, buf+3, &gpib_len, &send_eoi)) {
                       printf_P(PSTR("ERROR\r\n"));
                       break;
                      }
                      if(buf[2] == 'C') {
-                      gpib_state_from_cmd(gpib_buf, gpib_len); 
+                      gpib_state_from_cmd(buf+3, gpib_len); 
+                      led_set(gpib_state == GPIB_LISTEN ? LED_FAST : LED_OFF);
                       gpib_talk();
                       set_atn(1);
                       send_eoi = 0;
                      }
-                     result = gpib_transmit(gpib_buf, gpib_len, 0);
+                     result = gpib_transmit(buf+3, gpib_len, 0);
 
                      if (result == gpib_len) printf_P(PSTR("OK\r\n"));
                      else printf_P(PSTR("TIMEOUT %d\r\n"), (unsigned) result);
 
                      if(buf[2] == 'C') {
+                      if (result != gpib_len) gpib_addr_unknown();
                       set_atn(0);
                       if (gpib_state == GPIB_LISTEN) gpib_listen();
                      }
-                   } else if(buf[1] == 'B' && buf[2] == 'D'&& gpib_state != GPIB_LISTEN) { /* binary tx data */
+                   } else if(buf[1] == 'B' && (buf[2] == 'D' || buf[2] == 'W') && gpib_state != GPIB_LISTEN) { /* binary tx data */
                     uint8_t err = 0;
+                    /* TBW: the host doesn't wait for the result of each block, but keeps
+                       up to this many bytes (blocks with length bytes) unacknowledged */
+                    if(buf[2] == 'W') uart_tx(UART_RX_FIFO_SIZE-1);
                     while(1) {
                      gpib_len = uart_rx();
                      send_eoi = 0;
@@ -1162,10 +2033,12 @@ command_handler(uint8_t command, uint8_t *buf, uint8_t len)
                       send_eoi = GPIB_END_EOI;
                      }
                      if(gpib_len == 0) break;
-                     for(i = 0; i < gpib_len; i++) gpib_buf[i] = uart_rx();
                      if(!err) {
-                      result = gpib_transmit(gpib_buf, gpib_len, send_eoi);
+                      result = gpib_transmit_src(GPIB_SRC_UART, 0, gpib_len, send_eoi);
                       err = result != gpib_len;
+                     } else {
+                      for(i = 0; i < gpib_len; i++) (void)uart_rx();
+                      if(buf[2] == 'W') result = 0x80; /* skipped after a timeout */
                      }
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
@@ -1173,43 +2046,88 @@ command_handler(uint8_t command, uint8_t *buf, uint8_t len)
 #pragma GCC diagnostic pop
                     }
                    } else if((buf[1] == 'B' || buf[1] == 'H') && buf[2] == 'D') { /* hex & binary rx data */
-                    uint32_t l;
-                    
-                    l = get_read_length(buf+3, len-3);
-                    if(l == 0) l = 0xffffffff;
                     uart_rx_esc_char(); /* clear previous escape */
+                    gpib_rx_start(gpib_end_seq_rx, get_read_length(buf+3, len-3));
                     do {
-                     gpib_len = l > GPIB_BUF_SIZE ? GPIB_BUF_SIZE : l;
-                     result = gpib_receive(gpib_buf, gpib_len, &gpib_len, gpib_end_seq_rx);
-                     if(buf[1] == 'H') for (i=0; i<gpib_len; i++) printf_P(PSTR("%02X"), gpib_buf[i]);
+                     result = gpib_rx_wait(buf[1] == 'H' ? 0xff : 0x7f, &gpib_len);
+                     if(buf[1] == 'H') gpib_rx_to_uart(gpib_len, 1);
                      else if(gpib_len) {
                       uart_tx(gpib_len | ((result & GPIB_END_EOI) ? 0x80 : 0));
-                      uart_puts(gpib_buf, gpib_len);
+                      gpib_rx_to_uart(gpib_len, 0);
                      }
-                     l -= gpib_len;
-                    } while(result == GPIB_END_BUF && l != 0 && !uart_rx_esc_char());
+                    } while(result == GPIB_RX_MORE && !uart_rx_esc_char());
+                    gpib_rx_halt();
                     if(buf[1] == 'B') {
                      uart_tx(0);
                     } else {
                      if((result & GPIB_END_EOI) == 0) uart_tx(';');
                      printf_P(PSTR("\r\n"));
                     }
+                   } else if(buf[1] == 'U' && buf[2] == 'D' && gpib_state != GPIB_LISTEN) { /* unbuffered tx data */
+                    /* <ESC><ESC> is a literal <ESC>, <ESC><end> completes the transfer,
+                       EOI is sent with the last byte if <end> has GPIB_END_EOI bit.
+                       A byte is held until the next one arrives, so EOI can be set. */
+                    uint32_t n = 0;
+                    uint8_t c, pend = 0, have = 0;
+                    uint8_t err = !nrfd() && !ndac();
+                    gpib_tmo_start(gpib_tx_tmo);
+                    while(1) {
+                     c = uart_rx();
+                     if(c == 27) {
+                      c = uart_rx();
+                      if(c != 27) break;
+                     }
+                     if(have && !err) {
+                      err = !gpib_tx_byte(pend);
+                      n += !err;
+                     }
+                     pend = c;
+                     have = 1;
+                    }
+                    if(have && !err) {
+                     if(c & GPIB_END_EOI) eoi_set(1);
+                     err = !gpib_tx_byte(pend);
+                     n += !err;
+                    }
+                    gpib_tmo_stop();
+                    eoi_set(0);
+                    cfg_data_in();
+                    if(!err) printf_P(PSTR("OK\r\n"));
+                    else printf_P(PSTR("TIMEOUT %lu\r\n"), (unsigned long)n);
+                   } else if(buf[1] == 'U' && buf[2] == 'D') { /* unbuffered rx data */
+                    /* <ESC> is sent twice, the end of data is <ESC><result>:
+                       end flags, 0 on timeout or GPIB_RX_MORE if interrupted with <ESC> */
+                    uart_rx_esc_char(); /* clear previous escape */
+                    gpib_rx_start(gpib_end_seq_rx, 0);
+                    do {
+                     result = gpib_rx_wait(0xff, &gpib_len);
+                     while(gpib_len--) {
+                      uint8_t c = gpib_rx_getc();
+                      if(c == 27) uart_tx(27);
+                      uart_tx(c);
+                     }
+                    } while(result == GPIB_RX_MORE && !uart_rx_esc_char());
+                    gpib_rx_halt();
+                    uart_tx(27);
+                    uart_tx(result);
                    } else {
                     printf_P(PSTR("ERROR\r\n"));
                    }
                    break;
                     
+#ifdef GPIB_BENCH
+           case 'M':
+                   gpib_bench_tx(read_dec((const char*)buf+1, len-1));
+                   break;
+#endif
            case 'O':
                    if(get_set_opt(buf+1, len-1)) {
-                    if(buf[1] == 'B') {
-                     while(!uart_tx_empty());
-                     _delay_ms(1); /* data may remain in registers, wait for transmission
-                                      caller should wait at least 2ms after OK responce before
-                                      transmitting data with new BR */
-                     uart_set_speed(uart_baud);
-                    }
+                    if(buf[1] == 'B' || buf[1] == 'u') uart_speed_update();
                    }
 
+                   break;
+           case 'F':
+                   framed_loop(buf);
                    break;
            case '+':
                    if(buf[1] == '+') return EV_PX_CMD|EV_LEDIT_RESET;
@@ -1246,43 +2164,30 @@ static uint8_t errcode4;
 #define HP3478_CMD_REMOTE                32 /* leave REN active */
 #define HP3478_CMD_CONT     (HP3478_CMD_REMOTE|HP3478_CMD_TALK|HP3478_CMD_LISTEN)
 #define HP3478_DISP_HIDE_ANNUNCIATORS    64
+#define HP3478_CMD_PGM                  128 /* cmd is in the flash */
 
 uint8_t hp3478_saved_state[2];
 
+/* sends cmd to the device at addr/sad */
 static uint8_t 
-hp3478_cmd(const uint8_t *cmd, uint8_t len, uint8_t flags)
+gpib_dev_cmd(uint8_t addr, uint8_t sad, const uint8_t *cmd, uint8_t len, uint8_t flags)
 {
- uint8_t st = gpib_state;
- uint8_t cmd1[2];
+ uint8_t end = flags & (GPIB_END_LF|GPIB_END_CR|GPIB_END_EOI);
 
  set_ren(1);
- if(st != GPIB_TALK) {
-   if(st == GPIB_LISTEN) gpib_talk();
-   cmd1[0] = gpib_hp3478_addr+GPIB_LISTEN_ADDR_OFFSET;
-   cmd1[1] = gpib_my_addr+GPIB_TALK_ADDR_OFFSET;
-   set_atn(1);
-   if(!gpib_transmit_b(cmd1, 2, 0)) {
-    errcode = 1;
-    goto fail;
-   }
-   set_atn(0);
+ if(!gpib_address(gpib_my_addr, addr, sad)) {
+  errcode = 1;
+  goto fail;
  }
- if(!gpib_transmit_b(cmd, len, flags & (GPIB_END_LF|GPIB_END_CR|GPIB_END_EOI))) {
+ if(gpib_transmit_src(flags & HP3478_CMD_PGM ? GPIB_SRC_PGM : GPIB_SRC_RAM,
+                      cmd, len, end) != len + gpib_end_len(end)) {
   errcode = 2;
   goto fail;
  }
  if((flags & HP3478_CMD_REMOTE) == 0) set_ren(0);
- if((flags & HP3478_CMD_TALK) == 0) {
-  cmd1[0] = '?';
-  set_atn(1);
-  if(!gpib_transmit_b(cmd1, 1, 0)) {
-   errcode = 3;
-   goto fail;
-  }
-  set_atn(0);
-  gpib_state = 0;
- } else {
-  gpib_state = GPIB_TALK;
+ if((flags & HP3478_CMD_TALK) == 0 && !gpib_unaddress(GPIB_UNL)) {
+  errcode = 3;
+  goto fail;
  }
 
  return 1;
@@ -1290,131 +2195,56 @@ fail:
  set_atn(0);
  set_ren(0);
  gpib_state = 0;
+ gpib_addr_unknown();
  return 0;
 }
 
 static uint8_t 
-hp3478_cmd_P(const char *cmd, uint8_t flags)
+hp3478_cmd(const uint8_t *cmd, uint8_t len, uint8_t flags)
 {
- uint8_t st = gpib_state;
- uint8_t cmd1[2];
-
- set_ren(1);
- if(st != GPIB_TALK) {
-   if(st == GPIB_LISTEN) gpib_talk();
-   cmd1[0] = gpib_hp3478_addr+GPIB_LISTEN_ADDR_OFFSET;
-   cmd1[1] = gpib_my_addr+GPIB_TALK_ADDR_OFFSET;
-   set_atn(1);
-   if(!gpib_transmit_b(cmd1, 2, 0)) {
-    errcode = 1;
-    goto fail;
-   }
-   set_atn(0);
- }
- if(!gpib_transmit_P((const uint8_t*)cmd, strlen_P(cmd), GPIB_END_LF)) {
-  errcode = 2;
-  goto fail;
- }
- if((flags & HP3478_CMD_REMOTE) == 0) set_ren(0);
- if((flags & HP3478_CMD_TALK) == 0) {
-  cmd1[0] = '?';
-  set_atn(1);
-  if(!gpib_transmit_b(cmd1, 1, 0)) {
-   errcode = 3;
-   goto fail;
-  }
-  set_atn(0);
-  gpib_state = 0;
- } else {
-  gpib_state = GPIB_TALK;
- }
+ return gpib_dev_cmd(gpib_hp3478_addr, gpib_hp3478_sad, cmd, len, flags);
+}
 
- return 1;
-fail:
- set_atn(0);
- set_ren(0);
- gpib_state = 0;
- return 0;
+static uint8_t 
+hp3478_cmd_P(const char *cmd, uint8_t flags)
+{
+ return gpib_dev_cmd(gpib_hp3478_addr, gpib_hp3478_sad, (const uint8_t*)cmd, strlen_P(cmd),
+                     flags|HP3478_CMD_PGM|HP3478_CMD_END_LF);
 }
 
 static uint8_t
 hp3478_get_srq_status(uint8_t *sb)
 {
- uint8_t cmd[3];
- uint8_t rl;
- uint8_t st = gpib_state;
-
- if(st == GPIB_LISTEN) gpib_talk();
- gpib_state = 0;
- cmd[0] = 24; /* serial poll enable */
- cmd[1] = gpib_hp3478_addr+GPIB_TALK_ADDR_OFFSET;
- cmd[2] = gpib_my_addr+GPIB_LISTEN_ADDR_OFFSET;
- set_atn(1);
- if(!gpib_transmit_b(cmd, 3, 0)) {
-  errcode = 4;
-  goto fail;
- }
- set_atn(0);
- gpib_listen();
- gpib_receive(sb, 1, &rl, 0);
- if(rl != 1) {
-  errcode = 5;
-  goto fail;
- }
- gpib_talk();
- set_atn(1);
- cmd[0] = 25; /* serial poll disable */
- cmd[1] = '_';
- if(!gpib_transmit_b(cmd, 2, 0)) {
-  errcode = 6;
-  goto fail;
+ /* stays addressed if we were reading from the hp3478a */
+ uint8_t err = gpib_serial_poll(gpib_hp3478_addr, gpib_hp3478_sad, sb);
+ if(err) {
+  errcode = 3+err;
+  return 0;
  }
- set_atn(0);
  return 1;
-fail:
- gpib_talk();
- set_atn(0);
- return 0;
 }
 
 static uint8_t
 hp3478_read(uint8_t *buf, uint8_t buf_sz, uint8_t *rl, uint8_t flags)
 {
- uint8_t cmd[2];
-
- if(gpib_state != GPIB_LISTEN) {
-  cmd[0] = gpib_my_addr+GPIB_LISTEN_ADDR_OFFSET;
-  cmd[1] = gpib_hp3478_addr+GPIB_TALK_ADDR_OFFSET;
-  set_atn(1);
-  if(!gpib_transmit_b(cmd, 2, 0)) {
-   errcode = 7;
-   goto fail;
-  }
-  set_atn(0);
-  gpib_listen();
+ if(!gpib_address(gpib_hp3478_addr, gpib_my_addr, gpib_hp3478_sad)) {
+  errcode = 7;
+  goto fail;
  }
  if(gpib_receive(buf, buf_sz, rl, GPIB_END_EOI) != GPIB_END_EOI) {
   errcode = 8;
   goto fail;
  }
- if((flags & HP3478_CMD_LISTEN) == 0) {
-  gpib_talk();
-  set_atn(1);
-  cmd[0] = '_';
-  if(!gpib_transmit_b(cmd, 1, 0)) {
-   errcode = 9;
-   goto fail;
-  }
-  set_atn(0);
-  gpib_state = 0;
- } else {
-  gpib_state = GPIB_LISTEN;
+ if((flags & HP3478_CMD_LISTEN) == 0 && !gpib_unaddress(GPIB_UNT)) {
+  errcode = 9;
+  goto fail;
  }
  return 1;
 fail:
  gpib_talk();
  set_atn(0);
  gpib_state = 0;
+ gpib_addr_unknown();
  return 0;
 }
 
@@ -2510,8 +3340,8 @@ preset_save(uint8_t num, uint8_t st[5])
   hp3478_init_mode = s;
   hp3478_init_ext_mode = hp3478_menu_prev_pos;
  }
- eeprom_write_word((uint16_t*)(EEP_ADDR_MODE+num*EEP_PRESET_SIZE), s);
- eeprom_write_byte((uint8_t*)(EEP_ADDR_EXT_MODE+num*EEP_PRESET_SIZE), hp3478_menu_prev_pos);
+ eeprom_write_word((uint16_t*)(uintptr_t)(EEP_ADDR_MODE+num*EEP_PRESET_SIZE), s);
+ eeprom_write_byte((uint8_t*)(uintptr_t)(EEP_ADDR_EXT_MODE+num*EEP_PRESET_SIZE), hp3478_menu_prev_pos);
 
  for(i = 0; i < sizeof(opts)/sizeof(opts[0]); i++) {
   memcpy_P(&o, opts+i, sizeof(*opts));
@@ -2553,8 +3383,8 @@ preset_load(uint8_t num)
  uint8_t st1, st2;
  uint8_t i, include = 0;
 
- val = eeprom_read_word((uint16_t*)(EEP_ADDR_MODE+num*EEP_PRESET_SIZE));
- i = eeprom_read_byte((uint8_t*)(EEP_ADDR_EXT_MODE+num*EEP_PRESET_SIZE));
+ val = eeprom_read_word((uint16_t*)(uintptr_t)(EEP_ADDR_MODE+num*EEP_PRESET_SIZE));
+ i = eeprom_read_byte((uint8_t*)(uintptr_t)(EEP_ADDR_EXT_MODE+num*EEP_PRESET_SIZE));
  st1 = val&0xff;
  st2 = val>>8;
  if((st1 & HP3478_ST_FUNC) == 0 || (st1 & HP3478_ST_RANGE) == 0 || (st1 & HP3478_ST_N_DIGITS) == 0
@@ -3023,19 +3853,6 @@ load_settings(void)
  }
 }
 
-static uint16_t
-read_dec(const char *buf, uint8_t len)
-{
- uint16_t val = 0;
- while(len) {
-  char ch = *buf++;
-  if(ch < '0' || ch > '9') return val;
-  val = val*10 + (ch-'0');
-  len--;
- }
- return val;
-}
-
 static uint8_t px_eos2flags(uint8_t eos)
 {
  uint8_t f = 0;
@@ -3071,29 +3888,59 @@ px_cmd_cmp_1arg(const char *cmd, const char *buf, uint8_t len, uint16_t *arg)
  return 1;
 }
 
+/* Prologix emulation.
+   Fed from the main loop one character at a time, so SRQ and the ext mode
+   are serviced between the host's commands. buf is the line editor's
+   buffer, which is unused meanwhile. Lines starting with ++ are commands,
+   other data is sent to the ++addr device as it arrives, of any length.
+   An unescaped <CR> or <LF> ends it, the terminator set with ++eos/++eoi
+   follows. <ESC> makes the next character literal, unescaped <ESC> and
+   '+' are dropped. The meter's address (D option) stays for the ext
+   mode. */
+#define PX_ESC  1 /* the next character is literal */
+#define PX_PLUS 2 /* got a '+' at the beginning of a line */
+#define PX_CMD  4 /* reading a ++ command */
+#define PX_DATA 8 /* the line has data */
+#define PX_DROP 16 /* sending failed, the rest of the line is dropped */
+struct px_dev {
+ uint8_t addr; /* 0xff: the entry is free */
+ uint8_t sad;
+ uint8_t tx_term;
+ uint8_t autoread; /* ++auto, read after each line sent */
+ uint16_t read_tmo;
+};
+
+static struct {
+ uint8_t st;
+ uint8_t pos;
+ /* settings of the devices used with ++addr, d is the current one */
+ struct px_dev dev[PX_DEVICES];
+ struct px_dev *d;
+ uint8_t dev_next; /* replaced when the table is full */
+ uint8_t eot_enable;
+ uint8_t eot_char; /* sent after data ending with EOI if eot_enable */
+ uint8_t savecfg; /* ++addr is saved to the EEPROM, nothing else is */
+ uint16_t data_ts; /* msec_get() of the last data byte */
+} px;
+
+/* timeout is in 0.1ms units. The DAV interrupt fills the rx ring while
+   the main loop passes it to the UART, so the bus and the UART transfer
+   at the same time. */
 static void
-px_read(uint8_t *buf, uint8_t buf_sz, uint8_t end_flags, uint16_t timeout)
+px_read(uint8_t end_flags, uint16_t timeout)
 {
- uint8_t cmd[2];
- uint16_t t;
-
- cmd[0] = gpib_my_addr+GPIB_LISTEN_ADDR_OFFSET;
- cmd[1] = gpib_hp3478_addr+GPIB_TALK_ADDR_OFFSET;
- set_atn(1);
- if(!gpib_transmit_b(cmd, 2, 0)) {
-  set_atn(0);
-  return;
- }
- set_atn(0);
- gpib_listen();
-
- t = timeout;
- while(1) {
-  uint8_t rl, i;
-  uint8_t r = gpib_receive(buf, buf_sz, &rl, end_flags);
-  for(i = 0; i < rl; i++) uart_tx(buf[i]);
-  if(r == GPIB_END_EOI) break;
-  if(!uart_rx_empty()) {
+ uint16_t rx_tmo = gpib_rx_tmo;
+ uint8_t r, n;
+
+ /* the device stays addressed, so consecutive reads need no ATN cycle */
+ if(!gpib_address(px.d->addr, gpib_my_addr, px.d->sad)) return;
+
+ gpib_rx_tmo = timeout;
+ gpib_rx_start(end_flags, 0);
+ do {
+  r = gpib_rx_wait(0xff, &n);
+  gpib_rx_to_uart(n, 0);
+  if(r == GPIB_RX_MORE && !uart_rx_empty()) {
    uint8_t ch = uart_peek();
    if(ch != '\r' && ch != '\n') break;
    else (void)uart_rx(); /* Don't interrupt read if we got an empty string.
@@ -3101,107 +3948,268 @@ px_read(uint8_t *buf, uint8_t buf_sz, uint8_t end_flags, uint16_t timeout)
                             I don't know if <CR><LF> support is needed, but
                             handling like this seems to be logical. */
   }
-  if(rl == 0) {
-   if(t <= GPIB_MAX_RECEIVE_TIMEOUT_mS) break;
-   t -= GPIB_MAX_RECEIVE_TIMEOUT_mS;
-  } else t = timeout;
- }
+ } while(r == GPIB_RX_MORE);
+ gpib_rx_halt();
+ if((r & GPIB_END_EOI) && px.eot_enable) uart_tx(px.eot_char);
+ gpib_rx_tmo = rx_tmo;
+}
 
- gpib_talk();
- set_atn(1);
- cmd[0] = '_';
- gpib_transmit_b(cmd, 1, 0);
- set_atn(0);
+/* secondary address in the 96-126 form to GPIB_ADDR_NONE or 0-30 */
+static uint8_t
+px_sad(uint16_t a)
+{
+ return a >= 96 && a <= 126 ? a-GPIB_SECONDARY_ADDR_OFFSET : GPIB_ADDR_NONE;
 }
 
+/* the meter's address (D option) stays for the ext mode. Scripts switch
+   devices often, only changed bytes are written. */
 static void
-px_loop(uint8_t *buf, uint8_t len)
+px_save_addr(void)
 {
- uint8_t cmd_start = 0;
- uint8_t bufpos;
-#define PX_ESC 1
- uint8_t st = 0;
- uint8_t tx_term = 0;
- uint16_t read_timeout_ms = GPIB_MAX_RECEIVE_TIMEOUT_mS;
+ gpib_px_addr = px.d->addr;
+ gpib_px_sad = px.d->sad;
+ eeprom_update_byte((void*)EEP_ADDR_GPIB_PX_ADDR, gpib_px_addr);
+ eeprom_update_byte((void*)EEP_ADDR_GPIB_PX_SAD, gpib_px_sad);
+}
 
- len -= 2;
- memmove(buf, buf+2, len);
- bufpos = len;
+static void
+px_dev_init(struct px_dev *d, uint8_t addr, uint8_t sad)
+{
+ d->addr = addr;
+ d->sad = sad;
+ d->tx_term = 0;
+ d->autoread = 0;
+ d->read_tmo = gpib_rx_tmo;
+}
 
- gpib_talk();
- set_ren(0);
- gpib_state = 0;
- while(1) {
-  uint16_t cmdarg;
-  char *cmd = (char*)buf+cmd_start;
-  len = bufpos - cmd_start;
-  if(px_cmd_cmp(PSTR("ver"), cmd, len)) {
+/* ++addr: switches to the settings of the device, a new one starts with
+   the defaults */
+static void
+px_select(uint8_t addr, uint8_t sad)
+{
+ uint8_t i;
+
+ for(i = 0; i < PX_DEVICES; i++) {
+  if(px.dev[i].addr == addr && px.dev[i].sad == sad) {
+   px.d = px.dev+i;
+   return;
+  }
+ }
+ for(i = 0; i < PX_DEVICES && px.dev[i].addr != 0xff; i++);
+ if(i == PX_DEVICES) {
+  i = px.dev_next;
+  px.dev_next = (i+1) % PX_DEVICES;
+ }
+ px.d = px.dev+i;
+ px_dev_init(px.d, addr, sad);
+}
+
+/* ++trg [pad [sad] ...], GET to the listed devices or the current one */
+static void
+px_trg(uint8_t *buf, uint8_t len)
+{
+ uint16_t a[8];
+ uint8_t cmd[2+2*8+1];
+ uint8_t i, n, l = 0;
+
+ if(len == 3) {
+  a[0] = px.d->addr;
+  a[1] = px.d->sad+GPIB_SECONDARY_ADDR_OFFSET;
+  n = px.d->sad == GPIB_ADDR_NONE ? 1 : 2;
+ } else n = read_dec_list(buf+4, len-4, a, 8);
+ if(!n) return;
+ cmd[l++] = '?';
+ cmd[l++] = gpib_my_addr+GPIB_TALK_ADDR_OFFSET;
+ for(i = 0; i < n; i++) {
+  if(a[i] <= 30) cmd[l++] = a[i]+GPIB_LISTEN_ADDR_OFFSET;
+  else if(i && px_sad(a[i]) != GPIB_ADDR_NONE) cmd[l++] = a[i];
+  else return;
+ }
+ cmd[l++] = GPIB_GET;
+ gpib_send_cmd(cmd, l);
+}
+
+/* runs a ++ command, buf has it without the ++, returns 1 for ++exit */
+static uint8_t
+px_exec(uint8_t *buf, uint8_t len)
+{
+ uint16_t cmdarg;
+ char *cmd = (char*)buf;
+
+ if(px_cmd_cmp(PSTR("ver"), cmd, len)) {
 #define MKSTR1(x) #x
 #define MKSTR(x) MKSTR1(x)
-   printf_P(PSTR("GPIB HP3478EXT " MKSTR(HP3478EXT_VERSION) "\r\n"));
-  } else if(px_cmd_cmp_1arg(PSTR("addr"), cmd, len, &cmdarg)) {
-   gpib_hp3478_addr = cmdarg;
-   /* NOTE: gpib_state assumed to be 0 here */
-  } else if(px_cmd_cmp(PSTR("addr"), cmd, len)) {
-   printf_P(PSTR("%u\r\n"), (unsigned)gpib_hp3478_addr);
-  } else if(px_cmd_cmp_1arg(PSTR("read_tmo_ms"), cmd, len, &cmdarg)) {
-   read_timeout_ms = cmdarg;
-  } else if(px_cmd_cmp(PSTR("read_tmo_ms"), cmd, len)) {
-   printf_P(PSTR("%u\r\n"), read_timeout_ms);
-  } else if(px_cmd_cmp(PSTR("read eoi"), cmd, len) 
-               || px_cmd_cmp(PSTR("read"), cmd, len)) {
-   px_read(buf, CMD_BUF_SIZE, buf[cmd_start+4] == ' ' ? GPIB_END_EOI : 0, read_timeout_ms);
-  } else if(px_cmd_cmp(PSTR("mode"), cmd, len)) {
-   printf_P(PSTR("1\r\n"));
-  } else if(px_cmd_cmp_1arg(PSTR("auto"), cmd, len, &cmdarg)) {
-   /* TODO */
-  } else if(px_cmd_cmp(PSTR("auto"), cmd, len)) {
-   printf_P(PSTR("0\r\n"));
-  } else if(px_cmd_cmp(PSTR("eot_enable"), cmd, len)) {
-   printf_P(PSTR("0\r\n"));
-  } else if(px_cmd_cmp_1arg(PSTR("eoi"), cmd, len, &cmdarg)) {
-   if(cmdarg) tx_term |= HP3478_CMD_END_EOI;
-   else tx_term &= ~HP3478_CMD_END_EOI;
-  } else if(px_cmd_cmp(PSTR("eoi"), cmd, len)) {
-   printf_P(PSTR("%u\r\n"), (tx_term & HP3478_CMD_END_EOI) != 0);
-  } else if(px_cmd_cmp_1arg(PSTR("eos"), cmd, len, &cmdarg)) {
-   tx_term = (tx_term & ~(HP3478_CMD_END_LF|HP3478_CMD_END_CR)) | px_eos2flags(cmdarg);
-  } else if(px_cmd_cmp(PSTR("eos"), cmd, len)) {
-   printf_P(PSTR("%u\r\n"), px_flags2eos(tx_term));
-  } else if(px_cmd_cmp(PSTR("loc"), cmd, len)) {
-   set_ren(0);
-  } else if(px_cmd_cmp(PSTR("exit"), cmd, len)) {
-   set_ren(0);
-   return;
+  printf_P(PSTR("GPIB HP3478EXT " MKSTR(HP3478EXT_VERSION) "\r\n"));
+ } else if(px_cmd_cmp_1arg(PSTR("addr"), cmd, len, &cmdarg)) {
+  uint16_t a[2];
+  uint8_t n = read_dec_list((const uint8_t*)cmd+5, len-5, a, 2);
+  if(n && a[0] <= 30) {
+   px_select(a[0], n == 2 ? px_sad(a[1]) : GPIB_ADDR_NONE);
+   if(px.savecfg) px_save_addr();
   }
+ } else if(px_cmd_cmp(PSTR("addr"), cmd, len)) {
+  if(px.d->sad == GPIB_ADDR_NONE) uart_put_dec(px.d->addr);
+  else printf_P(PSTR("%u %u\r\n"), (unsigned)px.d->addr,
+                (unsigned)px.d->sad+GPIB_SECONDARY_ADDR_OFFSET);
+ } else if(px_cmd_cmp_1arg(PSTR("read_tmo_ms"), cmd, len, &cmdarg)) {
+  /* 0 would disable the timeout, the shortest one is 1ms */
+  px.d->read_tmo = cmdarg > 6553 ? 65534 : cmdarg ? cmdarg*10 : 10;
+ } else if(px_cmd_cmp(PSTR("read_tmo_ms"), cmd, len)) {
+  uart_put_dec(px.d->read_tmo/10);
+ } else if(px_cmd_cmp(PSTR("read eoi"), cmd, len) 
+              || px_cmd_cmp(PSTR("read"), cmd, len)) {
+  px_read(buf[4] == ' ' ? GPIB_END_EOI : 0, px.d->read_tmo);
+ } else if(px_cmd_cmp(PSTR("mode"), cmd, len)) {
+  printf_P(PSTR("1\r\n"));
+ } else if(px_cmd_cmp_1arg(PSTR("auto"), cmd, len, &cmdarg)) {
+  px.d->autoread = cmdarg != 0;
+ } else if(px_cmd_cmp(PSTR("auto"), cmd, len)) {
+  uart_put_dec(px.d->autoread);
+ } else if(px_cmd_cmp_1arg(PSTR("eot_enable"), cmd, len, &cmdarg)) {
+  px.eot_enable = cmdarg != 0;
+ } else if(px_cmd_cmp(PSTR("eot_enable"), cmd, len)) {
+  uart_put_dec(px.eot_enable);
+ } else if(px_cmd_cmp_1arg(PSTR("eot_char"), cmd, len, &cmdarg)) {
+  px.eot_char = cmdarg;
+ } else if(px_cmd_cmp(PSTR("eot_char"), cmd, len)) {
+  uart_put_dec(px.eot_char);
+ } else if(px_cmd_cmp(PSTR("spoll"), cmd, len)
+           || px_cmd_cmp_1arg(PSTR("spoll"), cmd, len, &cmdarg)) {
+  uint16_t a[2] = {px.d->addr, px.d->sad+GPIB_SECONDARY_ADDR_OFFSET};
+  uint8_t sb;
+  if(len != 5) a[1] = GPIB_ADDR_NONE+GPIB_SECONDARY_ADDR_OFFSET;
+  if((len == 5 || read_dec_list(buf+6, len-6, a, 2)) && a[0] <= 30
+     && !gpib_serial_poll(a[0], px_sad(a[1]), &sb)) uart_put_dec(sb);
+  else printf_P(PSTR("\r\n")); /* the host waits for a line */
+ } else if(px_cmd_cmp(PSTR("srq"), cmd, len)) {
+  uart_put_dec(srq() != 0);
+ } else if(px_cmd_cmp(PSTR("clr"), cmd, len)) {
+  uint8_t c = GPIB_SDC;
+  if(gpib_address(gpib_my_addr, px.d->addr, px.d->sad)) gpib_send_cmd(&c, 1);
+ } else if(px_cmd_cmp(PSTR("trg"), cmd, len)
+           || px_cmd_cmp_1arg(PSTR("trg"), cmd, len, &cmdarg)) {
+  px_trg(buf, len);
+ } else if(px_cmd_cmp(PSTR("ifc"), cmd, len)) {
+  gpib_ifc();
+ } else if(px_cmd_cmp(PSTR("rst"), cmd, len)) {
+  while(!uart_tx_empty());
+  wdt_enable(WDTO_15MS);
+  while(1);
+ } else if(px_cmd_cmp_1arg(PSTR("savecfg"), cmd, len, &cmdarg)) {
+  px.savecfg = cmdarg != 0;
+  if(px.savecfg) px_save_addr();
+ } else if(px_cmd_cmp(PSTR("savecfg"), cmd, len)) {
+  uart_put_dec(px.savecfg);
+ } else if(px_cmd_cmp_1arg(PSTR("eoi"), cmd, len, &cmdarg)) {
+  if(cmdarg) px.d->tx_term |= HP3478_CMD_END_EOI;
+  else px.d->tx_term &= ~HP3478_CMD_END_EOI;
+ } else if(px_cmd_cmp(PSTR("eoi"), cmd, len)) {
+  uart_put_dec((px.d->tx_term & HP3478_CMD_END_EOI) != 0);
+ } else if(px_cmd_cmp_1arg(PSTR("eos"), cmd, len, &cmdarg)) {
+  px.d->tx_term = (px.d->tx_term & ~(HP3478_CMD_END_LF|HP3478_CMD_END_CR)) | px_eos2flags(cmdarg);
+ } else if(px_cmd_cmp(PSTR("eos"), cmd, len)) {
+  uart_put_dec(px_flags2eos(px.d->tx_term));
+ } else if(px_cmd_cmp(PSTR("uart_err"), cmd, len)) {
+  uart_err_print(0);
+ } else if(px_cmd_cmp(PSTR("uart_err clear"), cmd, len)) {
+  uart_err_print(1);
+ } else if(px_cmd_cmp(PSTR("loc"), cmd, len)) {
+  set_ren(0);
+ } else if(px_cmd_cmp(PSTR("exit"), cmd, len)) {
+  gpib_unaddress(GPIB_UNL|GPIB_UNT);
+  set_ren(0);
+  return 1;
+ }
+ return 0;
 
-  bufpos = 0;
-  while(1) {
-   char ch = uart_rx();
-   if(st & PX_ESC) st &= ~PX_ESC;
-   else if(ch == '+') {
-    ch = uart_rx();
-    if(ch != '+') continue;
-    cmd_start = bufpos;
-    while(1) {
-     ch = uart_rx();
-     if(ch == '\r' || ch == '\n') break;
-     buf[bufpos++] = ch;
-    }
-    break; /* go to outer loop to process the command */
-   } else if(ch == 27) {
-    st |= PX_ESC;
-    continue;
-   } else if(ch == '\r' || ch == '\n') {
-    if(bufpos != 0) {
-     hp3478_cmd(buf, bufpos, tx_term|HP3478_CMD_REMOTE);
-    }
-    bufpos = 0;
-    continue;
-   }
-   buf[bufpos++] = ch;
+}
+
+/* buf has a ++ command line, returns 0 if it was ++exit */
+static uint8_t
+px_start(uint8_t *buf, uint8_t len)
+{
+ uint8_t i;
+
+ px.st = 0;
+ px.pos = 0;
+ for(i = 1; i < PX_DEVICES; i++) px.dev[i].addr = 0xff;
+ px.d = px.dev;
+ px.dev_next = 1;
+ px_dev_init(px.d, gpib_px_addr, gpib_px_sad);
+
+ /* a device left talking by a text mode read is untalked first */
+ gpib_unaddress(GPIB_UNT);
+ gpib_talk();
+ set_ren(0);
+ gpib_state = 0;
+ len -= 2;
+ memmove(buf, buf+2, len);
+ return !px_exec(buf, len);
+}
+
+/* Sends all but the last byte, which is held so the line end can go
+   with it. */
+static void
+px_flush(uint8_t *buf)
+{
+ if(px.pos < 2) return;
+ if(!gpib_dev_cmd(px.d->addr, px.d->sad, buf, px.pos-1, HP3478_CMD_REMOTE|HP3478_CMD_TALK)) {
+  px.st |= PX_DROP;
+  px.pos = 0;
+  return;
+ }
+ buf[0] = buf[px.pos-1];
+ px.pos = 1;
+}
+
+/* returns 1 after ++exit */
+static uint8_t
+px_input(uint8_t *buf, uint8_t ch)
+{
+ uint8_t len;
+
+ if(px.st & PX_CMD) {
+  if(ch == '\r' || ch == '\n') {
+   px.st = 0;
+   len = px.pos;
+   px.pos = 0;
+   return px_exec(buf, len);
+  }
+  if(px.pos < CMD_BUF_SIZE) buf[px.pos++] = ch;
+  return 0;
+ }
+ if(px.st & PX_PLUS) {
+  px.st &= ~PX_PLUS;
+  if(ch == '+') {
+   px.st = PX_CMD;
+   return 0;
   }
  }
+ if(px.st & PX_ESC) px.st &= ~PX_ESC;
+ else if(ch == 27) {
+  px.st |= PX_ESC;
+  return 0;
+ } else if(ch == '+') {
+  /* ++ starts a command at the beginning of a line, other unescaped '+'
+     are dropped like the other special characters */
+  if(!(px.st & PX_DATA)) px.st |= PX_PLUS;
+  return 0;
+ } else if(ch == '\r' || ch == '\n') {
+  if(px.pos && !(px.st & PX_DROP)
+     && gpib_dev_cmd(px.d->addr, px.d->sad, buf, px.pos,
+                     px.d->tx_term|HP3478_CMD_REMOTE|HP3478_CMD_TALK)
+     && px.d->autoread) px_read(GPIB_END_EOI, px.d->read_tmo);
+  px.pos = 0;
+  px.st &= ~(PX_DATA|PX_DROP);
+  return 0;
+ }
+ px.st |= PX_DATA;
+ px.data_ts = msec_get();
+ if(px.st & PX_DROP) return 0;
+ buf[px.pos++] = ch;
+ /* the data goes to the bus as it arrives */
+ if(px.pos == CMD_BUF_SIZE || uart_rx_empty()) px_flush(buf);
+ return 0;
 }
 
 void main(void) __attribute__((noreturn));
@@ -3211,21 +4219,31 @@ void main(void)
   uint8_t command;
   uint8_t bufPos;
   uint16_t timeout_ts = 0, timeout = 0;
-  uint8_t ev;
+  uint8_t ev, hold;
   uint8_t ext_state;
+  uint8_t px_active = 0;
+  uint16_t ubrr;
+
+  MCUSR = 0; /* the watchdog stays on after a reset by ++rst */
+  wdt_disable();
 
   PORT(LED_PORT) &= ~LED;
   DDR(LED_PORT) = LED;
+#ifdef BUZZ
   PORT(BUZZ_PORT) &= ~BUZZ;
   DDR(BUZZ_PORT) |= BUZZ;
+#endif
   
   TCCR0A = _BV(WGM01)|_BV(WGM00);
   OCR0A = 249; /* TOV will occur every 1ms for 16Mhz clock */
   TCCR0B = _BV(WGM02)|_BV(CS01)|_BV(CS00); /* /64 */
   TIMSK0 = _BV(TOIE0);
 
-  PCMSK1 = _BV(PCINT11); /* SRQ */
-  PCICR = _BV(PCIE1);
+  TCCR2A = _BV(WGM21); /* CTC */
+  OCR2A = 24; /* 100us for 16Mhz clock, see gpib_tmo_start */
+  TCCR2B = _BV(CS22); /* /64 */
+
+  gpib_hal_init();
 
   sei();
   
@@ -3235,10 +4253,25 @@ void main(void)
 
   if(gpib_hp3478_addr == 31) command = 'P';
 
+  ubrr = UART_UBRR_NONE;
+  if(uart_baud == UART_AUTO) ubrr = uart_autobaud(AUTOBAUD_WAIT_MS);
+  if(ubrr != UART_UBRR_NONE) uart_ubrr = ubrr; /* the saved one otherwise */
   uart_init(uart_baud);
+  if(uart_baud >= UART_UBRR) uart_set_ubrr(uart_ubrr);
+  if(ubrr != UART_UBRR_NONE) {
+   uint16_t t = msec_get();
+   uart_tx('U'); /* tells the host the rate is set */
+   /* the host repeats the 'U' until it sees the echo, the extra ones
+      would run as the U command */
+   while((uint16_t)(msec_get()-t) < AUTOBAUD_DRAIN_MS) {
+    if(uart_rx_empty()) continue;
+    if(uart_peek() != 'U') break;
+    uart_rx();
+    t = msec_get();
+   }
+  }
   fdevopen(uart_putchar, NULL);
   
-  PORT(SRQ_PORT) |= SRQ;
   gpib_talk();
 
   ext_state = 1; /* if !hp3478_ext_enable this will cause EV_EXT_DISABLE event */
@@ -3256,33 +4289,43 @@ void main(void)
   while (1) {
    // FIXME: ignore some commands so not to interrupt "EXT" mode
    ev = command_handler(command, buf, bufPos);
-   if((ev & EV_PX_CMD) != 0 && ext_state) {
-    ev |= EV_EXT_DISABLE;
-    ext_state = 0;
-   } else if(ext_state != hp3478_ext_enable) {
+   if(ext_state != hp3478_ext_enable) {
     ev |= hp3478_ext_enable?EV_EXT_ENABLE:EV_EXT_DISABLE;
     ext_state = hp3478_ext_enable;
    }
+   /* the ext mode would address the meter in the middle of a Prologix
+      message, SRQ and the timeout stay pending until the line ends or
+      no data came for PX_HOLD_MS */
+   hold = px_active && (px.st & PX_DATA);
    do {
     if(!uart_rx_empty()) ev |= EV_UART;
+    if(hold) {
+     if((uint16_t)(msec_get() - px.data_ts) < PX_HOLD_MS) continue;
+     hold = 0;
+    }
     if(gpib_srq_interrupt) {
      gpib_srq_interrupt = 0;
      if(srq()) ev |= EV_SRQ;
     }
     if(timeout != TIMEOUT_INF && (int16_t)(timeout_ts - msec_get()) <= 0) ev |= EV_TIMEOUT;
    } while(!ev);
-
    if(ev & (EV_SRQ|EV_TIMEOUT|EV_EXT_DISABLE|EV_EXT_ENABLE)) {
     timeout = hp3478a_handler(ev);
     if(timeout != TIMEOUT_CONT) timeout_ts = msec_get() + timeout;
    }
 
    if(ev & EV_PX_CMD) {
-    px_loop(buf, bufPos);
-    ev &= ~EV_UART; /* px_loop reads uart on it's own, so the flag is not valid anymore */
+    px_active = px_start(buf, bufPos);
+    if(px_active) ev &= ~EV_LEDIT_RESET; /* done when it exits */
    }
    if(ev & EV_LEDIT_RESET) line_edit(0, buf, &bufPos); /* prepare for the next command */
-   if(ev & EV_UART) command = line_edit(uart_rx(), buf, &bufPos);
-   else command = 0;
+   command = 0;
+   if(ev & EV_UART) {
+    if(!px_active) command = line_edit(uart_rx(), buf, &bufPos);
+    else if(px_input(buf, uart_rx())) {
+     px_active = 0;
+     line_edit(0, buf, &bufPos);
+    }
+   }
   }
 }
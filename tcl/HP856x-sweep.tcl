@@ -11,6 +11,7 @@ set power 0
 set norm 0
 set converter_addr 21
 set hp_addr 18
+set gpib_lib hp3478ext-gpib.tcl
 
 for {set i 0} {$i < [llength $argv]} {incr i} {
  switch -- [lindex $argv $i] {
@@ -36,6 +37,7 @@ for {set i 0} {$i < [llength $argv]} {incr i} {
        }
   }
   -norm - -normalize - -n {set norm 1}
+  -lib {set gpib_lib hp3478ext-lib.tcl}
   -points - -pts - -p {
        incr i
        set npts [lindex $argv $i] 
@@ -87,7 +89,7 @@ if {![info exists hp_port] || ![info exists rfe_port]} {
   }
 }
 
-source hp3478ext-gpib.tcl
+source $gpib_lib
 source rfesiggen.tcl
 
 gpibif_init $hp_port $converter_addr
@@ -119,8 +121,7 @@ for {set s 1} {$s <= $npts} {incr s} {
 
  rfegen_track_step $s
  if {$method ne "z"} { gpib_send $hp_addr "MKPK" }
- gpib_send $hp_addr "MKA?"
- set val [gpib_recv $hp_addr]
+ set val [gpib_query $hp_addr "MKA?"]
  set val [expr {$val}]
  lappend res $val
  puts "[expr {$s-1}]: $val"
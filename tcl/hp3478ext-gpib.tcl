@@ -24,6 +24,17 @@ proc gpibif_init {path addr {spd 500000} {bootloader_escape_method exit}} {
   after 50
  } elseif {$bootloader_escape_method eq "wait"} {
   after 1550
+ } elseif {$bootloader_escape_method eq "autobaud"} {
+  # firmware set to OB6: send 'U' at the wanted rate until it's echoed
+  fconfigure $gpib_fd -mode $spd,n,8,1
+  fconfigure $gpib_fd -blocking 0
+  set r ""
+  for {set i 0} {$i < 200 && [string first U $r] < 0} {incr i} {
+   puts -nonewline $gpib_fd U
+   after 20
+   set r [read $gpib_fd]
+  }
+  if {[string first U $r] < 0} {error "no response to the sync character"}
  } else {
   # no bootloader or DTR is disabled/disconnected
   fconfigure $gpib_fd -blocking 0
@@ -58,7 +69,7 @@ proc gpibif_init {path addr {spd 500000} {bootloader_escape_method exit}} {
   binary scan $r cu* x
   error "echo off failed: response \"$x\""
  }
- if {$spd != 115200} {
+ if {$spd != 115200 && $bootloader_escape_method ne "autobaud"} {
   switch $spd {
     500000 {set s 2}
     1000000 {set s 3}
@@ -106,36 +117,52 @@ proc gpib_send {dev c} {
  global gpib_fd
  set l [string length $c]
  set p 0
- set e 0
  set retrycnt 0
- puts -nonewline $gpib_fd "TBD\r"
  while {$l != 0} {
-  if {$l > 60} {set tl 60} else {set tl $l; set e 0x80}
-  incr tl -1
-  set hs [string range $c $p $p+$tl]
-  incr tl
-  puts -nonewline $gpib_fd [binary format c [expr {$tl+$e}]]
-  puts -nonewline $gpib_fd $hs
-  #puts $hs
-  #TODO: write next block before waiting for the result
-  set res [read $gpib_fd 1]
-  binary scan $res cu r
-  if {$r != $tl} {
-   puts -nonewline $gpib_fd [binary format c 0]
-   if {$r == 0 && $retrycnt > 10} {
-    error "write length $r < $tl @$p"
-   } else {
-    puts stderr "warining: $r < $tl @$p, retrying"
-    if {$r == 0} {incr retrycnt}
-    puts -nonewline $gpib_fd [binary format c 0]
-    puts -nonewline $gpib_fd "TBD\r"
+  puts -nonewline $gpib_fd "TBW\r"
+  binary scan [read $gpib_fd 1] cu win
+  # keep at least two blocks in flight
+  set bs [expr {min(60, $win/2-1)}]
+  set q {}
+  set inflight 0
+  set sp $p
+  set sl $l
+  set err 0
+  while {(!$err && $sl != 0) || [llength $q] != 0} {
+   if {$sl != 0 && !$err} {
+    if {$sl > $bs} {set tl $bs; set e 0} else {set tl $sl; set e 0x80}
+    if {$inflight+$tl+1 <= $win} {
+     puts -nonewline $gpib_fd [binary format c [expr {$tl+$e}]]
+     puts -nonewline $gpib_fd [string range $c $sp [expr {$sp+$tl-1}]]
+     lappend q $tl
+     incr inflight [expr {$tl+1}]
+     incr sp $tl
+     incr sl -$tl
+     continue
+    }
+   }
+   set tl [lindex $q 0]
+   set q [lrange $q 1 end]
+   incr inflight [expr {-$tl-1}]
+   binary scan [read $gpib_fd 1] cu r
+   # 0x80: block skipped after a short write
+   if {$r == 0x80} continue
+   incr l -$r
+   incr p $r
+   if {$r != $tl} {
+    set err 1
+    set rr $r
    }
   }
-  
-  incr l -$r
-  incr p $r
+  puts -nonewline $gpib_fd [binary format c 0]
+  if {$err} {
+   if {$rr == 0 && $retrycnt > 10} {
+    error "write length $rr @$p"
+   }
+   puts stderr "warining: short write @$p, retrying"
+   if {$rr == 0} {incr retrycnt}
+  }
  }
- puts -nonewline $gpib_fd [binary format c 0]
 }
 
 proc gpib_recv {dev} {
@@ -160,6 +187,11 @@ proc gpib_recv {dev} {
  return $res
 }
 
+proc gpib_query {dev c} {
+ gpib_send $dev $c
+ return [gpib_recv $dev]
+}
+
 proc gpibif_find_port {portid} {
   set devs [glob -tails -directory "/dev/serial/by-id/" *]
   foreach i $devs {
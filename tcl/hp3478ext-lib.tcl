@@ -0,0 +1,70 @@
+
+# The procs of hp3478ext-gpib.tcl on top of the host library
+# (make -C host gpibext.so). gpib_send doesn't wait for the converter, its
+# result is checked by the next gpib_recv or gpibif_close, so commands and
+# the following query go out in one burst. The path may be the socket of
+# host/gpibd. The bootloader escape methods aren't needed: the library
+# retries while the board is in the bootloader.
+
+set gpibext_lib [file join [file dirname [file normalize [info script]]] .. host gpibext.so]
+
+proc gpibif_init {path addr {spd 500000} {bootloader_escape_method exit}} {
+ global gpib_h gpib_pending
+ if {[info commands gpibext::open] eq ""} {load $::gpibext_lib}
+ set gpib_h [gpibext::open $path $spd]
+ set gpib_pending {}
+ $gpib_h option C $addr
+}
+
+# waits for the writes in flight, raises their errors
+proc gpib_sync {} {
+ global gpib_h gpib_pending
+ set p $gpib_pending
+ set gpib_pending {}
+ foreach id $p {$gpib_h complete $id}
+}
+
+# only R and L, the other text commands aren't available in framed mode
+proc gpibif_send_cmd {c} {
+ global gpib_h
+ switch $c {
+  R {$gpib_h ren 1}
+  L {gpib_sync; $gpib_h ren 0}
+  default {error "unsupported command $c"}
+ }
+}
+
+proc gpib_send {dev c} {
+ global gpib_h
+ lappend ::gpib_pending [$gpib_h submit send $dev $c]
+}
+
+proc gpib_recv {dev} {
+ global gpib_h
+ set id [$gpib_h submit recv $dev]
+ gpib_sync
+ set res [$gpib_h complete $id]
+ if {!([$gpib_h end] & 4) && [string length $res] != 0} {
+  error "no eoi after [string length $res] bytes"
+ }
+ return $res
+}
+
+proc gpib_query {dev c} {
+ gpib_send $dev $c
+ return [gpib_recv $dev]
+}
+
+proc gpibif_find_port {portid} {
+  set devs [glob -tails -directory "/dev/serial/by-id/" *]
+  foreach i $devs {
+    if {$i eq $portid} {return /dev/[file tail [file readlink /dev/serial/by-id/$i]]}
+  }
+  return ""
+}
+
+proc gpibif_close {} {
+ global gpib_h
+ gpib_sync
+ $gpib_h close
+}
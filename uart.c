@@ -9,6 +9,35 @@
 #define UART_UBRR_1M (1)
 #define UART_UBRR_2M (0)
 
+#define RX_MASK (UART_RX_FIFO_SIZE-1)
+#define TX_MASK (UART_TX_FIFO_SIZE-1)
+
+#ifdef UART_FLOW_CTRL
+#define UART_CAT(a, b) a ## b
+#define UART_REG(r, p) UART_CAT(r, p)
+/* RTS is raised with a quarter of the ring free, host UARTs may send a few
+   more bytes, and lowered again when half of it is free */
+#define RTS_STOP (UART_RX_FIFO_SIZE-UART_RX_FIFO_SIZE/4)
+#define RTS_GO   (UART_RX_FIFO_SIZE/2)
+static volatile uint8_t rts_stop;
+static inline void rts_set(uint8_t stop)
+{
+ if(stop) UART_REG(PORT, UART_RTS_PORT) |= UART_RTS;
+ else UART_REG(PORT, UART_RTS_PORT) &= ~UART_RTS;
+ rts_stop = stop;
+}
+#endif
+static volatile uint16_t err_cnt[UART_ERR_NUM];
+static inline void
+err_inc(uint8_t i)
+{
+  if(err_cnt[i] != 0xffff) err_cnt[i]++;
+}
+
+#ifdef UART_CTS_PORT
+static inline uint8_t cts(void) {return !(UART_REG(PIN, UART_CTS_PORT) & UART_CTS);}
+#endif
+
 
 void 
 uart_init(uint8_t spd) 
@@ -18,6 +47,68 @@ uart_init(uint8_t spd)
   UCSR0A = _BV(U2X0);
   UCSR0C = _BV(UCSZ01) | _BV(UCSZ00); /* 8N1 */
   UCSR0B = _BV(RXEN0) | _BV(TXEN0) | _BV(RXCIE0) | _BV(UDRIE0);
+#ifdef UART_FLOW_CTRL
+  rts_set(0);
+  UART_REG(DDR, UART_RTS_PORT) |= UART_RTS;
+#endif
+#ifdef UART_CTS_PORT
+  UART_REG(DDR, UART_CTS_PORT) &= ~UART_CTS; /* no pullup, must be connected */
+#endif
+}
+
+void
+uart_set_ubrr(uint16_t ubrr)
+{
+ UBRR0 = ubrr;
+}
+
+/* Detects the host rate from a 'U' (0x55): its start bit and data bits
+   give five falling edges, two bit times apart. RXD is polled with
+   interrupts disabled for one Timer1 overflow at a time, Timer1 counts the
+   CPU clock. An edge found late because an interrupt ran in between gives
+   uneven gaps, the measurement is dropped and the host's next 'U' is
+   timed. Must be called before uart_init(), the buzzer can't use Timer1 at
+   the same time. Waits up to tmo_ms for a good measurement, returns its
+   UBRR value or UART_UBRR_NONE. */
+#define RXD_HIGH (PIND & _BV(PD0))
+uint16_t
+uart_autobaud(uint16_t tmo_ms)
+{
+ uint16_t ovf = tmo_ms/4+1, e[5], t; /* Timer1 overflows every 4.096ms */
+ uint8_t i, sreg = SREG;
+
+ TCCR1A = 0;
+ TCCR1B = _BV(CS10);
+ for(; ovf; ovf--) {
+  cli();
+  TCNT1 = 0;
+  TIFR1 = _BV(TOV1);
+  while(RXD_HIGH) if(TIFR1 & _BV(TOV1)) goto next;
+  TCNT1 = 0;
+  /* 65536 cycles for 8 bits, down to about 2000 baud */
+  for(i = 1; i < 5; i++) {
+   while(!RXD_HIGH) if(TIFR1 & _BV(TOV1)) goto next;
+   while(RXD_HIGH) if(TIFR1 & _BV(TOV1)) goto next;
+   e[i] = TCNT1;
+  }
+  while(!RXD_HIGH) if(TIFR1 & _BV(TOV1)) goto next; /* the last data bit */
+  SREG = sreg;
+  /* each gap within 1/16 of the average, plus a few cycles of polling */
+  t = e[4];
+  for(e[0] = 0, i = 1; i < 5; i++) {
+   uint16_t d = e[i]-e[i-1];
+   if((d > t/4 ? d-t/4 : t/4-d) > t/64+8) break;
+  }
+  if(i == 5 && t >= 32) {
+   TCCR1B = 0;
+   /* 8 bits take 64*(ubrr+1) cycles with U2X */
+   return (t+32)/64-1;
+  }
+next:
+  SREG = sreg;
+ }
+ TCCR1B = 0;
+ return UART_UBRR_NONE;
 }
 
 void
@@ -49,21 +140,29 @@ static volatile uint8_t esc = 0;
 
 ISR(USART_RX_vect)
 {
- uint8_t prev, next, b;
+ uint8_t prev, next, b, st;
 
- if(UCSR0A & _BV(FE0)) {
+ st = UCSR0A;
+ if(st & _BV(FE0)) {
    (void) UDR0;
+   err_inc(UART_ERR_FRAME);
    return;
  }
 
  b = UDR0;
+ if(st & _BV(DOR0)) err_inc(UART_ERR_OVERRUN); /* b is valid, the lost ones preceded it */
  if(b == 27) esc = 1;
  prev = rx_wp;
- next = prev+1;
- if(next == UART_RX_FIFO_SIZE) next = 0;
- if(next == rx_rp) return; /* overrun */
+ next = (prev+1) & RX_MASK;
+ if(next == rx_rp) { /* overrun */
+   err_inc(UART_ERR_RING);
+   return;
+ }
  rx_ring[prev] = b;
  rx_wp = next;
+#ifdef UART_FLOW_CTRL
+ if(((next-rx_rp) & RX_MASK) >= RTS_STOP) rts_set(1);
+#endif
 }
 
 ISR(USART_UDRE_vect)
@@ -71,14 +170,26 @@ ISR(USART_UDRE_vect)
  uint8_t next;
 
  next = tx_rp;
+#ifdef UART_CTS_PORT
+ if(next == tx_wp || !cts()) UCSR0B &= ~_BV(UDRIE0); /* uart_cts_poll resumes */
+#else
  if(next == tx_wp) UCSR0B &= ~_BV(UDRIE0);
+#endif
  else {
   UDR0 = tx_ring[next];
-  if(++next == UART_TX_FIFO_SIZE) next = 0;
-  tx_rp = next;
+  tx_rp = (next+1) & TX_MASK;
  }
 }
 
+#ifdef UART_CTS_PORT
+/* called from the 1ms timer interrupt */
+void
+uart_cts_poll(void)
+{
+ if(tx_rp != tx_wp && cts()) UCSR0B |= _BV(UDRIE0);
+}
+#endif
+
 uint8_t
 uart_rx_esc_char(void)
 {
@@ -94,21 +205,55 @@ uart_tx(uint8_t b)
 {
   uint8_t prev, next;
   prev = tx_wp;
-  next = prev+1;
-  if(next == UART_TX_FIFO_SIZE) next = 0;
-  while(next == tx_rp);
+  next = (prev+1) & TX_MASK;
+  if(next == tx_rp) {
+    err_inc(UART_ERR_TX_STALL);
+    while(next == tx_rp);
+  }
   tx_ring[prev] = b;
   tx_wp = next;
   UCSR0B |= _BV(UDRIE0);
 }
 
+/* Copies len bytes to the tx ring, waiting for room as needed. Only the
+   write index is shared with the interrupt, it's updated once per chunk. */
+void
+uart_write(const uint8_t *s, uint8_t len)
+{
+  uint8_t wp, n;
+  while(len) {
+    wp = tx_wp;
+    if((n = (tx_rp-wp-1) & TX_MASK) == 0) {
+      err_inc(UART_ERR_TX_STALL);
+      while((n = (tx_rp-wp-1) & TX_MASK) == 0);
+    }
+    if(n > len) n = len;
+    len -= n;
+    do {
+      tx_ring[wp] = *s++;
+      wp = (wp+1) & TX_MASK;
+    } while(--n);
+    tx_wp = wp;
+    UCSR0B |= _BV(UDRIE0);
+  }
+}
+
+void
+uart_err_get(uint16_t *cnt, uint8_t clear)
+{
+  uint8_t i;
+  cli();
+  for(i = 0; i < UART_ERR_NUM; i++) {
+    cnt[i] = err_cnt[i];
+    if(clear) err_cnt[i] = 0;
+  }
+  sei();
+}
+
 uint8_t
 uart_rx_count(void)
 {
- int8_t s;
- s = rx_wp-rx_rp;
- if(s < 0) s += UART_RX_FIFO_SIZE;
- return s;
+ return (rx_wp-rx_rp) & RX_MASK;
 }
 
 uint8_t
@@ -131,8 +276,11 @@ uart_rx(void)
   uint8_t next = rx_rp;
   while (rx_wp == next);
   b = rx_ring[next];
-  if(++next == UART_RX_FIFO_SIZE) next = 0;
+  next = (next+1) & RX_MASK;
   rx_rp = next;
+#ifdef UART_FLOW_CTRL
+  if(rts_stop && ((rx_wp-next) & RX_MASK) <= RTS_GO) rts_set(0);
+#endif
   return b;
 }
 
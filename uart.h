@@ -1,9 +1,35 @@
 #pragma once
+/* ring sizes, powers of 2 up to 256, can be set at build time */
+#ifndef UART_TX_FIFO_SIZE
 #define UART_TX_FIFO_SIZE 64
+#endif
+#ifndef UART_RX_FIFO_SIZE
 #define UART_RX_FIFO_SIZE 64
+#endif
+#if (UART_TX_FIFO_SIZE & (UART_TX_FIFO_SIZE-1)) || UART_TX_FIFO_SIZE > 256 \
+    || (UART_RX_FIFO_SIZE & (UART_RX_FIFO_SIZE-1)) || UART_RX_FIFO_SIZE > 256
+#error "UART ring sizes must be powers of 2 up to 256"
+#endif
+
+/* Hardware flow control (UART_FLOW_CTRL).
+   RTS output, to the host's CTS: low while the rx ring has room. It's on the
+   buzzer pin (D10) unless UART_RTS_PORT/UART_RTS are defined, the basic
+   board has no buzzer. CTS input, from the host's RTS, is optional: define
+   UART_CTS_PORT/UART_CTS to stop transmitting while it's high. */
+#ifdef UART_FLOW_CTRL
+#ifndef UART_RTS_PORT
+#define UART_RTS_PORT B
+#define UART_RTS _BV(PB2)
+#define UART_RTS_ON_BUZZER
+#endif
+#ifdef UART_CTS_PORT
+void uart_cts_poll(void);
+#endif
+#endif
 
 void uart_init(uint8_t spd);
 void uart_tx(uint8_t b);
+void uart_write(const uint8_t *s, uint8_t len);
 uint8_t uart_tx_empty(void);
 uint8_t uart_rx_count(void);
 uint8_t uart_rx_empty(void);
@@ -11,8 +37,22 @@ uint8_t uart_rx_esc_char(void);
 uint8_t uart_rx(void);
 uint8_t uart_peek(void);
 
+/* error counters, saturate at 0xffff */
+#define UART_ERR_FRAME    0 /* frame error, the byte is dropped */
+#define UART_ERR_OVERRUN  1 /* data overrun, bytes were lost before the ISR */
+#define UART_ERR_RING     2 /* rx ring overflow, the byte is dropped */
+#define UART_ERR_TX_STALL 3 /* a write waited for room in the tx ring */
+#define UART_ERR_NUM      4
+void uart_err_get(uint16_t *cnt, uint8_t clear);
+
 #define UART_115200 0
 #define UART_500K   2
 #define UART_1M     3
 #define UART_2M     4
+#define UART_UBRR   5 /* UBRR from the ubrr option */
+#define UART_AUTO   6 /* detected at startup, like UART_UBRR otherwise */
 void uart_set_speed(uint8_t spd);
+/* U2X is set, the rate is 2MHz/(ubrr+1) */
+void uart_set_ubrr(uint16_t ubrr);
+#define UART_UBRR_NONE 0xffff
+uint16_t uart_autobaud(uint16_t tmo_ms);